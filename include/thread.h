@@ -3,9 +3,17 @@
 
 #include <stdio.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 #define THREAD_CANCEL_ENABLE       0
 #define THREAD_CANCEL_DISABLE      1
 
+#define THREAD_PRIO_MIN            0
+#define THREAD_PRIO_MAX            7
+#define THREAD_PRIO_DEFAULT        3
+
 
 /* identifiant de thread */
 typedef struct thread * thread_t;
@@ -20,24 +28,288 @@ thread_t thread_self(void);
  */
 int thread_create(thread_t *newthread, void *(*func)(void *), void *funcarg);
 
+/* comme thread_create, mais l'argument est la zone [arg, arg+size[,
+ * recopiée pour le nouveau thread qui reçoit un pointeur vers sa copie.
+ * L'appelant peut donc la réutiliser dès le retour, et la copie vit aussi
+ * longtemps que le thread. Jusqu'à 64 octets, elle est rangée dans le
+ * descripteur; au delà, en haut de la pile du thread. Aucune allocation
+ * n'est faite pour elle.
+ * renvoie 0 en cas de succès, -1 en cas d'erreur ou si size dépasse
+ * THREAD_COPY_MAX (ou le quart de la taille des piles).
+ */
+#define THREAD_COPY_MAX            512
+
+int thread_create_copy(thread_t *newthread, void *(*func)(void *),
+		const void *arg, size_t size);
+
+/* attributs de création d'un thread, à initialiser par thread_attr_init.
+ */
+#define THREAD_CREATE_JOINABLE     0
+#define THREAD_CREATE_DETACHED     1
+#define THREAD_SPAWN_HELP_FIRST    0
+#define THREAD_SPAWN_WORK_FIRST    1
+
+typedef struct thread_attr {
+	size_t stacksize;   /* 0 : taille fixée par thread_setstacksize */
+	void *stackaddr;    /* pile fournie par l'appelant, ou NULL */
+	int prio;           /* -1 : priorité du créateur */
+	int kthread;        /* -1 : thread noyau du créateur */
+	int detachstate;
+	int spawnmode;
+} thread_attr_t;
+
+/* initialiser les attributs avec les valeurs par défaut, celles de
+ * thread_create.
+ * retourne 0.
+ */
+int thread_attr_init(thread_attr_t *attr);
+
+/* taille de la pile allouée par la bibliothèque (au moins 16 Ko).
+ * retourne 0 en cas de succès, -1 si la taille est trop petite.
+ */
+int thread_attr_setstacksize(thread_attr_t *attr, size_t size);
+
+/* utiliser la zone [addr, addr+size[ comme pile. Elle n'est ni allouée ni
+ * libérée par la bibliothèque, n'a pas de page de garde et doit rester
+ * valide jusqu'à ce que le thread soit joint (ou terminé s'il est
+ * détaché). Aucune allocation n'est alors faite pour la pile.
+ * retourne 0 en cas de succès, -1 si la zone est invalide ou trop petite.
+ */
+int thread_attr_setstack(thread_attr_t *attr, void *addr, size_t size);
+
+/* priorité initiale du thread (voir thread_setpriority).
+ * retourne 0 en cas de succès, -1 si la priorité est invalide.
+ */
+int thread_attr_setpriority(thread_attr_t *attr, int prio);
+
+/* numéro du thread noyau (entre 0 et thread_getconcurrency()-1) sur lequel
+ * le thread démarre. Il peut ensuite être volé par un autre thread noyau.
+ * retourne 0 en cas de succès, -1 si le numéro est invalide.
+ */
+int thread_attr_setkthread(thread_attr_t *attr, int kthread);
+
+/* THREAD_CREATE_DETACHED : le thread ne peut pas être joint, sa pile et son
+ * descripteur sont libérés dès qu'il termine. L'identifiant renvoyé par
+ * thread_create_attr ne doit alors plus être utilisé.
+ * retourne 0 en cas de succès, -1 si l'état est invalide.
+ */
+int thread_attr_setdetachstate(thread_attr_t *attr, int state);
+
+/* THREAD_SPAWN_HELP_FIRST (par défaut) : le nouveau thread est mis en file
+ * et le créateur continue.
+ * THREAD_SPAWN_WORK_FIRST : le nouveau thread démarre tout de suite sur le
+ * thread noyau courant, et c'est la suite du créateur qui est mise en file
+ * où les autres threads noyaux peuvent la voler. Adapté aux algorithmes
+ * récursifs (diviser pour régner). Sans effet si le thread a une priorité
+ * plus basse que son créateur ou doit démarrer sur un autre thread noyau.
+ * retourne 0 en cas de succès, -1 si le mode est invalide.
+ */
+int thread_attr_setspawnmode(thread_attr_t *attr, int mode);
+
+/* comme thread_create, avec les attributs 'attr' (NULL : attributs par
+ * défaut). newthread peut être NULL pour un thread détaché.
+ * renvoie 0 en cas de succès, -1 en cas d'erreur.
+ */
+int thread_create_attr(thread_t *newthread, const thread_attr_t *attr,
+		void *(*func)(void *), void *funcarg);
+
+/* poster une tâche sans pile: func(arg) sera exécutée jusqu'au bout par un
+ * thread noyau, sur sa propre pile, entre deux threads. Une tâche coûte à
+ * peu près un appel de fonction. Elle ne doit ni bloquer ni passer la main
+ * (pas de thread_join, thread_yield, mutex ou condition), et thread_self()
+ * n'y a pas de sens. Elle peut aussi être exécutée par un thread qui
+ * attend dans thread_post_wait, sur la pile de celui-ci : sa pile ne doit
+ * pas dépasser celle des threads. Si counter n'est pas NULL, il est
+ * incrémenté maintenant et décrémenté une fois la tâche faite.
+ * renvoie 0.
+ */
+int thread_post(void (*func)(void *), void *arg, unsigned long *counter);
+
+/* attendre que le compteur des tâches postées avec thread_post revienne à
+ * 0. En attendant, l'appelant exécute lui-même des tâches en attente.
+ * Appelée depuis un pthread qui n'est pas un thread noyau de la
+ * bibliothèque, elle attend sans exécuter de tâche.
+ * renvoie 0.
+ */
+int thread_post_wait(unsigned long *counter);
+
 /* passer la main à un autre thread.
  */
 int thread_yield(void);
 
+/* passer la main au thread target, directement et sans passer par la file
+ * des threads prêts, s'il est prêt et qu'il a été le dernier à passer la
+ * main sur ce thread noyau (cas d'un échange entre deux threads). Sinon,
+ * équivaut à thread_yield.
+ * renvoie 0.
+ */
+int thread_yield_to(thread_t target);
+
+/* fixer le nombre de threads noyaux utilisés par la bibliothèque, thread
+ * principal compris. Au démarrage, c'est la valeur de la variable
+ * d'environnement THREAD_KTHREADS si elle existe, sinon le nombre de
+ * processeurs sur lesquels le processus peut s'exécuter.
+ * le nombre de threads noyaux ne peut qu'augmenter.
+ * retourne 0 en cas de succès, -1 en cas d'erreur.
+ */
+int thread_setconcurrency(int nbkthreads);
+
+/* récupérer le nombre de threads noyaux utilisés par la bibliothèque.
+ */
+int thread_getconcurrency(void);
+
+/* épingler chaque thread noyau sur un coeur: le i-ème thread noyau (le
+ * thread principal est le numéro 0) est fixé sur cpus[i % nbcpus]. si cpus
+ * est NULL, chaque thread noyau est fixé sur un coeur distinct parmi ceux
+ * autorisés. les threads noyaux créés ensuite sont épinglés de la même façon.
+ * au démarrage, la variable d'environnement THREAD_CPUS (par exemple
+ * "0,2,4-7") ou THREAD_PIN=1 ont le même effet.
+ * retourne 0 en cas de succès, -1 en cas d'erreur.
+ */
+int thread_setaffinity(const int *cpus, int nbcpus);
+
+/* régler le nombre de parcours des files qu'un thread noyau inactif fait
+ * avant de s'endormir. Plus la valeur est grande, plus un thread réveillé
+ * est repris vite, au prix de temps CPU consommé à attendre. 0 endort les
+ * threads noyaux immédiatement. La valeur initiale peut être donnée par la
+ * variable d'environnement THREAD_IDLE_SPIN.
+ * retourne 0 en cas de succès.
+ */
+int thread_setidlespin(unsigned int spins, unsigned int *oldspins);
+
+/* fixer la taille de pile des threads créés ensuite (32 Ko par défaut),
+ * arrondie au multiple de la taille de page supérieur.
+ * Chaque pile est précédée d'une page de garde : un débordement provoque une
+ * erreur de segmentation au lieu de corrompre la mémoire voisine. Seules les
+ * pages effectivement utilisées sont allouées par le noyau ; les piles de
+ * taille différente de celle par défaut ne sont pas recyclées. La valeur
+ * initiale peut être donnée par la variable d'environnement
+ * THREAD_STACK_SIZE (en octets). L'ancienne valeur est renvoyée dans
+ * 'oldsize' si non NULL.
+ * retourne 0 en cas de succès, -1 si la taille est inférieure à 16 Ko.
+ */
+int thread_setstacksize(size_t size, size_t *oldsize);
+
+/* quand au moins 'backlog' threads attendent déjà dans la file locale,
+ * thread_create exécute directement la fonction du nouveau thread avant de
+ * rendre la main et renvoie un thread terminé, qui se joint normalement. Le
+ * thread est exécuté sur la pile du créateur s'il y reste au moins la taille
+ * de sa pile, comme pour thread_join, sinon sur sa propre pile, le créateur
+ * attendant sa fin. Le créateur ne doit donc pas attendre une action du
+ * thread créé entre thread_create et thread_join, sauf à être annulé par
+ * thread_cancel, qui le réveille. 0 désactive ce comportement. La valeur
+ * initiale (256 par défaut) peut être donnée par la variable
+ * d'environnement THREAD_SPAWN_BACKLOG. L'ancienne valeur est renvoyée dans
+ * 'oldbacklog' si non NULL.
+ * retourne 0 en cas de succès.
+ */
+int thread_setspawnbacklog(unsigned int backlog, unsigned int *oldbacklog);
+
+/* régler la préemption des threads utilisateurs. Un thread qui garde un
+ * thread noyau pendant plus de 'usec' microsecondes de temps CPU sans
+ * jamais rendre la main est interrompu et remis dans la file des threads
+ * prêts. 0 (la valeur par défaut) désactive la préemption. La valeur
+ * initiale peut être donnée par la variable d'environnement
+ * THREAD_TIMESLICE. L'ancienne valeur est renvoyée dans 'oldusec' si non
+ * NULL.
+ * retourne 0 en cas de succès.
+ */
+int thread_settimeslice(unsigned int usec, unsigned int *oldusec);
+
+/* interdire puis autoriser de nouveau la préemption du thread courant. Les
+ * appels peuvent être imbriqués. Quand la préemption est activée, les
+ * appels à des fonctions qui ne sont pas async-signal-safe (malloc, stdio,
+ * ...) doivent être entourés de ces deux fonctions. Une préemption
+ * survenue entre les deux a lieu dans thread_preempt_enable.
+ */
+void thread_preempt_disable(void);
+void thread_preempt_enable(void);
+
+/* détacher un thread : il ne pourra plus être joint et sa pile et son
+ * descripteur sont rendus aux caches de la bibliothèque dès qu'il termine
+ * (immédiatement s'il a déjà terminé). L'identifiant ne doit plus être
+ * utilisé ensuite. Le thread principal ne peut pas être détaché.
+ * retourne 0 en cas de succès, -1 si le thread est déjà détaché.
+ */
+int thread_detach(thread_t thread);
+
+/* fixer la priorité d'un thread, entre THREAD_PRIO_MIN et THREAD_PRIO_MAX.
+ * Les threads prêts de plus haute priorité sont exécutés les premiers, un
+ * thread qui attend depuis longtemps gagne peu à peu des niveaux pour ne pas
+ * être affamé. thread_yield ne cède la main qu'à un thread de priorité au
+ * moins égale. Un thread créé hérite de la priorité de son créateur
+ * (THREAD_PRIO_DEFAULT pour le thread principal). La nouvelle priorité
+ * prend effet la prochaine fois que le thread est mis en file.
+ * retourne 0 en cas de succès, -1 si la priorité est invalide.
+ */
+int thread_setpriority(thread_t thread, int prio);
+
+/* récupérer la priorité d'un thread.
+ */
+int thread_getpriority(thread_t thread);
+
 /* changer l'état d'annulation du thread entre activé et désactivé.
  * retourne 0 en cas de succès.
  */
 int thread_setcancelstate(int state, int *oldstate);
 
-/* changer le type d'annulation du thread entre asynchrone et déférré.
+/* demander l'annulation d'un thread. L'annulation est différée : le thread
+ * se termine comme par thread_exit(THREAD_CANCELED) au prochain point
+ * d'annulation où son annulation est activée. Les points d'annulation sont
+ * thread_testcancel, thread_yield, thread_yield_to, thread_join,
+ * thread_cond_wait, thread_group_wait et thread_post_wait (pas
+ * thread_mutex_lock). Un thread bloqué dans thread_join ou thread_group_wait
+ * est réveillé tout de suite, sans effet sur le thread ou le groupe qu'il
+ * attendait. Un thread bloqué dans thread_cond_wait est réveillé comme par
+ * thread_cond_signal : ses gestionnaires de nettoyage sont appelés une fois
+ * le mutex repris. Un thread qui n'a pas encore démarré est retiré des
+ * files et terminé sur le champ, sans jamais s'exécuter. Un thread annulé
+ * doit toujours être joint, sauf s'il est détaché.
  * retourne 0 en cas de succès.
  */
+#define THREAD_CANCELED            ((void *) -1)
 
 int thread_cancel(thread_t thread);
 
+/* point d'annulation explicite, pour les boucles de calcul qui ne font
+ * appel à aucune autre fonction de la bibliothèque.
+ */
+void thread_testcancel(void);
+
+/* gestionnaires de nettoyage : routine(arg) est appelée si le thread se
+ * termine (thread_exit ou annulation) entre thread_cleanup_push et
+ * thread_cleanup_pop, ou par thread_cleanup_pop si execute est non nul.
+ * Les gestionnaires sont appelés dans l'ordre inverse de leur ajout, avec
+ * l'annulation désactivée. Comme pour pthread, les deux macros ouvrent et
+ * ferment un bloc et doivent être appariées dans la même fonction ; rien
+ * n'est alloué.
+ */
+struct thread_cleanup {
+	void (*routine)(void *);
+	void *arg;
+	struct thread_cleanup *prev;
+};
+
+#define thread_cleanup_push(routine, arg) \
+	{ struct thread_cleanup __thread_cleanup = { (routine), (arg), NULL }; \
+	  _thread_cleanup_push(&__thread_cleanup);
+
+#define thread_cleanup_pop(execute) \
+	  _thread_cleanup_pop(&__thread_cleanup, (execute)); }
+
+/* utilisées par les macros ci-dessus.
+ */
+void _thread_cleanup_push(struct thread_cleanup *cleanup);
+void _thread_cleanup_pop(struct thread_cleanup *cleanup, int execute);
+
 /* attendre la fin d'exécution d'un thread.
  * la valeur renvoyée par le thread est placée dans *retval.
  * si retval est NULL, la valeur de retour est ignorée.
+ * un thread qui n'a pas encore démarré peut être exécuté directement sur la
+ * pile de l'appelant, sans changement de contexte, s'il reste sur celle-ci
+ * au moins la taille de pile du thread attendu (jamais sur la pile du thread
+ * principal). Sinon il reçoit sa propre pile et l'appelant lui passe la main
+ * directement, sans passer par l'ordonnanceur, puis la reprend à sa fin.
  */
 int thread_join(thread_t thread, void **retval);
 
@@ -51,4 +323,117 @@ int thread_join(thread_t thread, void **retval);
  */
 void thread_exit(void *retval) __attribute__ ((__noreturn__));
 
+
+/* groupes de threads.
+ *
+ * les threads créés dans un groupe sont détachés : ils n'ont pas
+ * d'identifiant et leur descripteur est rendu dès qu'ils terminent. Le
+ * groupe compte ceux qui n'ont pas encore terminé, thread_group_wait
+ * attend que ce compte tombe à zéro sans consommer de temps CPU.
+ * les champs de la structure sont privés.
+ */
+typedef struct thread_group {
+	int lock;
+	unsigned long count;
+	thread_t first;
+	thread_t waiter;
+} thread_group_t;
+
+#define THREAD_GROUP_INITIALIZER { 0, 0, NULL, NULL }
+
+/* initialiser et détruire un groupe.
+ * thread_group_destroy retourne -1 si des threads du groupe n'ont pas
+ * terminé.
+ */
+int thread_group_init(thread_group_t *group);
+int thread_group_destroy(thread_group_t *group);
+
+/* créer un thread dans le groupe, comme thread_create_attr (attr peut être
+ * NULL ; son detachstate est ignoré).
+ * renvoie 0 en cas de succès, -1 en cas d'erreur.
+ */
+int thread_group_create(thread_group_t *group, const thread_attr_t *attr,
+		void *(*func)(void *), void *funcarg);
+
+/* attendre que tous les threads du groupe aient terminé, y compris ceux
+ * qu'ils y ont eux-mêmes créés entre temps. Un seul thread à la fois peut
+ * attendre un groupe. C'est un point d'annulation : thread_cancel réveille
+ * le thread qui attend, le groupe garde ses threads.
+ * retourne 0, ou -1 si un autre thread attend déjà le groupe.
+ */
+int thread_group_wait(thread_group_t *group);
+
+/* annuler tous les threads du groupe qui n'ont pas encore terminé, comme
+ * thread_cancel : ceux qui n'ont pas démarré sont terminés sur le champ, les
+ * autres au prochain point d'annulation. Leur valeur de retour est perdue.
+ * retourne 0.
+ */
+int thread_group_cancel(thread_group_t *group);
+
+
+
+/* mutex et variables de condition.
+ *
+ * un thread qui attend un mutex ou une condition ne consomme pas de temps
+ * CPU : il est retiré des files de threads prêts jusqu'à ce qu'on le réveille.
+ * les champs des structures sont privés.
+ */
+typedef struct thread_mutex {
+	int state;
+	int lock;
+	thread_t owner;
+	thread_t waitfirst, waitlast;
+} thread_mutex_t;
+
+typedef struct thread_cond {
+	int lock;
+	thread_t waitfirst, waitlast;
+} thread_cond_t;
+
+#define THREAD_MUTEX_INITIALIZER { 0, 0, NULL, NULL, NULL }
+#define THREAD_COND_INITIALIZER  { 0, NULL, NULL }
+
+/* initialiser et détruire un mutex.
+ * thread_mutex_destroy retourne -1 si le mutex est pris.
+ */
+int thread_mutex_init(thread_mutex_t *mutex);
+int thread_mutex_destroy(thread_mutex_t *mutex);
+
+/* prendre un mutex. si son propriétaire s'exécute sur un autre thread
+ * noyau, on attend activement un court instant avant de s'endormir.
+ * retourne 0 en cas de succès.
+ */
+int thread_mutex_lock(thread_mutex_t *mutex);
+
+/* prendre un mutex s'il est libre.
+ * retourne 0 en cas de succès, -1 si le mutex est déjà pris.
+ */
+int thread_mutex_trylock(thread_mutex_t *mutex);
+
+/* rendre un mutex. s'il y a des threads en attente, le premier d'entre eux
+ * en devient directement propriétaire.
+ */
+int thread_mutex_unlock(thread_mutex_t *mutex);
+
+/* initialiser et détruire une variable de condition.
+ * thread_cond_destroy retourne -1 si des threads l'attendent encore.
+ */
+int thread_cond_init(thread_cond_t *cond);
+int thread_cond_destroy(thread_cond_t *cond);
+
+/* rendre le mutex et attendre la condition, puis reprendre le mutex.
+ */
+int thread_cond_wait(thread_cond_t *cond, thread_mutex_t *mutex);
+
+/* réveiller un (signal) ou tous (broadcast) les threads qui attendent la
+ * condition. ils sont directement placés en attente du mutex associé, sans
+ * passer par la file des threads prêts si le mutex est pris.
+ */
+int thread_cond_signal(thread_cond_t *cond);
+int thread_cond_broadcast(thread_cond_t *cond);
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif /* __THREAD_H__ */
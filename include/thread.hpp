@@ -0,0 +1,244 @@
+#ifndef __THREAD_HPP__
+#define __THREAD_HPP__
+
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <new>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+
+#include "thread.h"
+
+/* interface C++ typée au dessus de thread.h (C++17).
+ *
+ *   auto t = uthread::spawn([&] { return calcul(x); });
+ *   int r = t.join();
+ *
+ *   uthread::parallel_invoke([&] { trier(gauche); }, [&] { trier(droite); });
+ *
+ * Une uthread::task<T> n'est ni copiable ni déplaçable: la fermeture et le
+ * résultat sont rangés dans la tâche elle-même, qui vit dans le cadre de pile
+ * du créateur. Seules les fermetures plus grandes que THREAD_CLOSURE_SIZE
+ * sont allouées sur le tas. Le thread est toujours joignable, quel que soit
+ * l'état de détachement demandé dans les attributs. Le destructeur attend la
+ * fin du thread s'il n'a pas été joint.
+ */
+
+#ifndef THREAD_CLOSURE_SIZE
+#define THREAD_CLOSURE_SIZE 64 /* octets de fermeture rangés dans la tâche */
+#endif
+
+namespace uthread {
+
+namespace detail {
+
+// where the thread stores what its closure returned
+template <typename T>
+class slot {
+public:
+	template <typename F>
+	void run(F &f) { new (buf_) T(f()); full_ = true; }
+
+	T take() {
+		T *v = std::launder(reinterpret_cast<T *>(buf_));
+		T r(std::move(*v));
+		v->~T();
+		full_ = false;
+		return r;
+	}
+
+	~slot() {
+		if (full_) {
+			std::launder(reinterpret_cast<T *>(buf_))->~T();
+		}
+	}
+
+private:
+	alignas(T) unsigned char buf_[sizeof (T)];
+	bool full_ = false;
+};
+
+template <>
+class slot<void> {
+public:
+	template <typename F>
+	void run(F &f) { (void) f(); }
+
+	void take() {}
+};
+
+} // namespace detail
+
+
+template <typename T>
+class task {
+	static_assert(!std::is_reference<T>::value,
+			"return a pointer or a std::reference_wrapper instead");
+
+public:
+	/* démarrer un thread qui exécute f(), avec les attributs attr (NULL :
+	 * attributs par défaut, voir thread_create_attr). Lève
+	 * std::runtime_error si le thread ne peut pas être créé.
+	 */
+	template <typename F>
+	explicit task(F &&f, const thread_attr_t *attr = nullptr)
+	{
+		using C = std::decay_t<F>;
+		thread_attr_t a;
+
+		// the task is joined, whatever the caller asked for
+		if (attr) {
+			a = *attr;
+		} else {
+			thread_attr_init(&a);
+		}
+		a.detachstate = THREAD_CREATE_JOINABLE;
+
+		if constexpr (sizeof (C) <= THREAD_CLOSURE_SIZE
+				&& alignof (C) <= alignof (std::max_align_t)) {
+			closure_ = new (buf_) C(std::forward<F>(f));
+		} else {
+			closure_ = new C(std::forward<F>(f));
+		}
+		invoke_ = &call<C>;
+		drop_ = &drop<C>;
+
+		if (thread_create_attr(&th_, &a, &run, this)) {
+			drop<C>(this);
+			throw std::runtime_error("thread_create_attr");
+		}
+	}
+
+	task(const task &) = delete;
+	task &operator=(const task &) = delete;
+
+	~task()
+	{
+		if (!joined_) {
+			wait();
+		}
+	}
+
+	/* attendre la fin du thread et renvoyer ce que la fermeture a renvoyé
+	 * (par déplacement), ou relancer l'exception qu'elle a levée. Lève
+	 * std::runtime_error si thread_join échoue ou si le thread a été annulé
+	 * (thread_cancel sur native_handle()). À n'appeler qu'une fois.
+	 */
+	T join()
+	{
+		int err = wait();
+
+		if (err) {
+			throw std::runtime_error(err < 0 ? "thread_join" : "thread canceled");
+		}
+		if (error_) {
+			std::rethrow_exception(std::exchange(error_, nullptr));
+		}
+		return result_.take();
+	}
+
+	thread_t native_handle() const { return th_; }
+
+private:
+	// -1 if thread_join failed, 1 if the thread was cancelled, 0 otherwise
+	int wait()
+	{
+		void *res;
+
+		joined_ = true;
+		if (thread_join(th_, &res)) {
+			return -1;
+		}
+		if (THREAD_CANCELED == res) {
+			// cancelled before it started or in the middle of the closure
+			if (closure_) {
+				drop_(this);
+			}
+			return 1;
+		}
+		return 0;
+	}
+
+	template <typename C>
+	static void drop(task *t)
+	{
+		C *c = static_cast<C *>(t->closure_);
+
+		if (static_cast<void *>(c) == static_cast<void *>(t->buf_)) {
+			c->~C();
+		} else {
+			delete c;
+		}
+		t->closure_ = nullptr;
+	}
+
+	// in the new thread: the closure is destroyed as soon as it returns
+	template <typename C>
+	static void call(task *t)
+	{
+		try {
+			t->result_.run(*static_cast<C *>(t->closure_));
+		} catch (...) {
+			t->error_ = std::current_exception();
+		}
+		drop<C>(t);
+	}
+
+	static void *run(void *arg)
+	{
+		task *t = static_cast<task *>(arg);
+
+		t->invoke_(t);
+		return nullptr;
+	}
+
+	alignas(std::max_align_t) unsigned char buf_[THREAD_CLOSURE_SIZE];
+	void *closure_;
+	void (*invoke_)(task *);
+	void (*drop_)(task *);
+	thread_t th_;
+	bool joined_ = false;
+	std::exception_ptr error_;
+	detail::slot<T> result_;
+};
+
+
+/* démarrer un thread qui exécute f() et renvoyer la tâche correspondante.
+ */
+template <typename F>
+task<std::invoke_result_t<std::decay_t<F> &>> spawn(F &&f)
+{
+	return task<std::invoke_result_t<std::decay_t<F> &>>(std::forward<F>(f));
+}
+
+template <typename F>
+task<std::invoke_result_t<std::decay_t<F> &>> spawn(const thread_attr_t &attr,
+		F &&f)
+{
+	return task<std::invoke_result_t<std::decay_t<F> &>>(std::forward<F>(f),
+			&attr);
+}
+
+
+/* exécuter toutes les fonctions en parallèle et attendre qu'elles aient
+ * terminé. La dernière est exécutée par l'appelant, les valeurs renvoyées
+ * sont ignorées.
+ */
+template <typename F, typename... Fs>
+void parallel_invoke(F &&f, Fs &&...fs)
+{
+	if constexpr (sizeof... (Fs) == 0) {
+		std::invoke(std::forward<F>(f));
+	} else {
+		task<void> t(std::forward<F>(f));
+
+		parallel_invoke(std::forward<Fs>(fs)...);
+		t.join();
+	}
+}
+
+} // namespace uthread
+
+#endif /* __THREAD_HPP__ */
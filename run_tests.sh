@@ -13,12 +13,22 @@ echo "------------------------------------------------"
 echo "TEST: 13-join-cascade"
 ./tests/13-join-cascade 200
 echo "------------------------------------------------"
+echo "TEST: 14-join-inline 100"
+./tests/14-join-inline 100
+THREAD_KTHREADS=1 ./tests/14-join-inline 100
+echo "------------------------------------------------"
 echo "TEST: 21-create-many 40000"
 ./tests/21-create-many 40000
 echo "------------------------------------------------"
 echo "TEST: 22-create-many-recursive 4000"
 ./tests/22-create-many-recursive 4000
 echo "------------------------------------------------"
+echo "TEST: 23-create-many-queued 40000"
+./tests/23-create-many-queued 40000
+echo "------------------------------------------------"
+echo "TEST: 24-create-inline"
+THREAD_KTHREADS=1 ./tests/24-create-inline
+echo "------------------------------------------------"
 echo "TEST: 31-switch-many 400 800"
 ./tests/31-switch-many 400 800
 echo "------------------------------------------------"
@@ -34,11 +44,66 @@ echo "------------------------------------------------"
 echo "TEST: 53-quicksort 100"
 ./tests/53-quicksort 100
 echo "------------------------------------------------"
+echo "TEST: 53-quicksort 100 1"
+./tests/53-quicksort 100 1
+echo "------------------------------------------------"
 echo "TEST: 54-mergesort 100"
 ./tests/54-mergesort 100
 echo "------------------------------------------------"
+echo "TEST: 54-mergesort 100 1"
+./tests/54-mergesort 100 1
+echo "------------------------------------------------"
 echo "TEST: 55-increment 90000"
 ./tests/55-increment 90000
 echo "------------------------------------------------"
 echo "TEST: 56-cancel"
 ./tests/56-cancel
+echo "------------------------------------------------"
+echo "TEST: 57-preemption 1000"
+./tests/57-preemption 1000
+echo "------------------------------------------------"
+echo "TEST: 58-priority"
+THREAD_KTHREADS=1 ./tests/58-priority
+echo "------------------------------------------------"
+echo "TEST: 59-stack"
+./tests/59-stack
+echo "------------------------------------------------"
+echo "TEST: 60-attr"
+./tests/60-attr
+echo "------------------------------------------------"
+echo "TEST: 61-mutex 20 100"
+./tests/61-mutex 20 100
+echo "------------------------------------------------"
+echo "TEST: 62-cond 10 1000"
+./tests/62-cond 10 1000
+echo "------------------------------------------------"
+echo "TEST: 63-detach 20000"
+./tests/63-detach 20000
+echo "------------------------------------------------"
+echo "TEST: 64-post 1000000"
+./tests/64-post 1000000
+echo "------------------------------------------------"
+echo "TEST: 65-cxx 1000"
+./tests/65-cxx 1000
+echo "------------------------------------------------"
+echo "TEST: 66-create-copy 1000"
+./tests/66-create-copy 1000
+echo "------------------------------------------------"
+echo "TEST: 67-yield-to 100000"
+THREAD_KTHREADS=1 ./tests/67-yield-to 100000
+echo "------------------------------------------------"
+echo "TEST: 68-cancel-points"
+./tests/68-cancel-points
+THREAD_KTHREADS=1 ./tests/68-cancel-points
+echo "------------------------------------------------"
+echo "TEST: 69-group 10000"
+./tests/69-group 10000
+echo "------------------------------------------------"
+echo "TEST: 70-preempt-stress 30"
+./tests/70-preempt-stress 30
+echo "------------------------------------------------"
+echo "TEST: 71-join-inline-stack"
+./tests/71-join-inline-stack
+echo "------------------------------------------------"
+echo "TEST: 72-stack-limit"
+./tests/72-stack-limit
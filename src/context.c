@@ -0,0 +1,98 @@
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "context.h"
+
+
+#ifdef THREAD_UCONTEXT
+
+void context_make(context_t *c, void *stack, size_t size,
+		void (*func)(void *), void *arg)
+{
+	getcontext(c);
+	c->uc_stack.ss_sp = stack;
+	c->uc_stack.ss_size = size;
+	c->uc_link = NULL;
+	makecontext(c, (void (*)(void))func, 1, arg);
+}
+
+
+void context_swap(context_t *from, context_t *to)
+{
+	swapcontext(from, to);
+}
+
+#else
+
+// Stack layout of a suspended context, from the saved stack pointer upwards:
+//   MXCSR (4 bytes), x87 control word (4 bytes), r15, r14, r13, r12, rbx, rbp,
+//   return address
+__asm__ (
+	".text\n"
+	".globl context_swap\n"
+	".type context_swap, @function\n"
+	"context_swap:\n"
+	"	pushq %rbp\n"
+	"	pushq %rbx\n"
+	"	pushq %r12\n"
+	"	pushq %r13\n"
+	"	pushq %r14\n"
+	"	pushq %r15\n"
+	"	subq $8, %rsp\n"
+	"	stmxcsr (%rsp)\n"
+	"	fnstcw 4(%rsp)\n"
+	"	movq %rsp, (%rdi)\n"
+	"	movq (%rsi), %rsp\n"
+	"	ldmxcsr (%rsp)\n"
+	"	fldcw 4(%rsp)\n"
+	"	addq $8, %rsp\n"
+	"	popq %r15\n"
+	"	popq %r14\n"
+	"	popq %r13\n"
+	"	popq %r12\n"
+	"	popq %rbx\n"
+	"	popq %rbp\n"
+	"	ret\n"
+	".size context_swap, .-context_swap\n"
+
+	// first activation of a context made by context_make: r12 holds the
+	// function, r13 its argument
+	".type _context_start, @function\n"
+	"_context_start:\n"
+	"	movq %r13, %rdi\n"
+	"	callq *%r12\n"
+	"	ud2\n"
+	".size _context_start, .-_context_start\n"
+);
+
+void _context_start(void);
+
+
+void context_make(context_t *c, void *stack, size_t size,
+		void (*func)(void *), void *arg)
+{
+	uint64_t *sp;
+	uint32_t mxcsr;
+	uint16_t fpucw;
+
+	// inherit the floating point control words of the creator, as getcontext
+	// would have done
+	__asm__ volatile ("stmxcsr %0" : "=m" (mxcsr));
+	__asm__ volatile ("fnstcw %0" : "=m" (fpucw));
+
+	// once context_swap has popped the address of _context_start, rsp must be
+	// 16-byte aligned for the call to func
+	sp = (uint64_t *)(((uintptr_t)stack + size) & ~(uintptr_t)15);
+	*--sp = (uint64_t)_context_start;   // popped by the ret of context_swap
+	*--sp = 0;                          // rbp
+	*--sp = 0;                          // rbx
+	*--sp = (uint64_t)func;             // r12
+	*--sp = (uint64_t)arg;              // r13
+	*--sp = 0;                          // r14
+	*--sp = 0;                          // r15
+	*--sp = (uint64_t)mxcsr | ((uint64_t)fpucw << 32);
+
+	c->sp = sp;
+}
+
+#endif
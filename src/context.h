@@ -0,0 +1,38 @@
+#ifndef __CONTEXT_H__
+#define __CONTEXT_H__
+
+#include <stddef.h>
+
+// Two context switch backends are available:
+// * the default one, written in assembly for x86-64, only saves the callee
+// saved registers, the stack pointer and the MXCSR/x87 control words. It does
+// not touch the signal mask, so a switch never enters the kernel.
+// * the ucontext one (getcontext/makecontext/swapcontext), selected with
+// -DTHREAD_UCONTEXT or automatically on other architectures.
+
+#if !defined(THREAD_UCONTEXT) && !defined(__x86_64__)
+#define THREAD_UCONTEXT
+#endif
+
+#ifdef THREAD_UCONTEXT
+#include <ucontext.h>
+typedef ucontext_t context_t;
+#else
+typedef struct context {
+	void *sp; // everything else is saved on the stack
+} context_t;
+#endif
+
+
+/* prepare c so that switching to it calls func(arg) on the given stack.
+ * func must never return.
+ */
+void context_make(context_t *c, void *stack, size_t size,
+		void (*func)(void *), void *arg);
+
+/* save the current context in from and resume to.
+ * from may be a context that has never been made: it is filled by the call.
+ */
+void context_swap(context_t *from, context_t *to);
+
+#endif /* __CONTEXT_H__ */
@@ -1,546 +1,3666 @@
 #define _GNU_SOURCE
-#include <ucontext.h>
-
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <setjmp.h>
 #include <unistd.h>
+#include <errno.h>
 #include <signal.h>
+#include <time.h>
+#include <sys/mman.h>
 #include <sys/syscall.h>
+#include <linux/futex.h>
 
 #include <pthread.h>
-#include <semaphore.h>
+#include <stdatomic.h>
 #include <valgrind/valgrind.h>
 
 #include <assert.h>
 
 #include "queue.h"
 #include "thread.h"
+#include "context.h"
 
-#ifndef NBKTHREADS
-#define NBKTHREADS 4 // INCLUDING the main thread!
-#endif
+#define MAX_KTHREADS 256 // INCLUDING the main thread!
 
-#define CONTEXT_STACK_SIZE 32*1024 /* 32 KB stack size for contexts */
+#define CONTEXT_STACK_SIZE 32*1024 /* 32 KB default stack size for contexts */
+#define STACK_MIN_SIZE 16*1024     /* smallest stack thread_setstacksize allows */
 #define KTHREAD_STACK_SIZE 4*1024  /* 4 KB stack size for kernel threads */
+#define FALLBACK_STACK_SIZE 8*1024*1024 /* main kthread loop, as a pthread's */
+#define INLINE_STACK_MARGIN 4*1024 /* room kept under an inlined thread's stack */
+
+#define DEQUE_SIZE 4096 /* capacity of a kthread's local run queue, power of 2 */
+#define TASKQ_SIZE 4096 /* capacity of a kthread's posted task queue, power of 2 */
+#define TASK_BATCH 256  /* posted tasks run in a row between two threads */
+#define STEAL_TICK 32   /* yields between two forced steal attempts */
+#define MUTEX_SPIN 100  /* attempts on a mutex whose owner is running */
+
+#define PRIO_LEVELS (THREAD_PRIO_MAX + 1)
+
+#ifndef SPAWN_BACKLOG
+#define SPAWN_BACKLOG 256 /* local jobs above which thread_create runs inline */
+#endif
+
+#ifndef ARG_INLINE_SIZE
+#define ARG_INLINE_SIZE 64 /* thread_create_copy arguments kept in the descriptor */
+#endif
+
+#ifndef AGING_QUANTUM
+#define AGING_QUANTUM 64 /* queue scans for a waiting job to gain one level */
+#endif
+
+#define PREEMPT_SIGNAL SIGRTMIN
+
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+#ifndef IDLE_SPIN
+#define IDLE_SPIN 64 /* default queue scans of an idle kthread before sleeping */
+#endif
+
+#define CACHELINE 64
+
+#define SLAB_SIZE 64 /* thread descriptors carved at once */
+
+#define STACK_CACHE_SIZE 16 /* stacks kept by each kthread */
+#define STACK_POOL_MAX 256  /* pooled stacks above this are trimmed */
+#define STACK_COLORS 8      /* stack tops are shifted by 0..7 cache lines */
+
+#ifndef MADV_FREE
+#define MADV_FREE MADV_DONTNEED
+#endif
 
 #define GETTID syscall(SYS_gettid)
 
+#if defined(__x86_64__) || defined(__i386__)
+#define CPU_RELAX() __builtin_ia32_pause()
+#else
+#define CPU_RELAX() do {} while (0)
+#endif
+
 static int maintid;
-ucontext_t mainfallback;
+static context_t mainfallback;
+static void *mainfallback_stack;
+
+
+TAILQ_HEAD(threadqueue, thread);
+
+
+// A Chase-Lev work-stealing deque: the owning kthread pushes and pops at
+// 'bottom' with plain loads and stores, other kthreads steal at 'top' with a
+// CAS. Only the kthread that owns the deque may call _deque_push and
+// _deque_pop on it.
+struct deque {
+	atomic_long top __attribute__((aligned(CACHELINE)));
+	atomic_long bottom __attribute__((aligned(CACHELINE)));
+	struct thread *_Atomic jobs[DEQUE_SIZE];
+};
+
+
+// A task posted with thread_post. It is stored by value in a Chase-Lev deque
+// like the one above: a thief may read a slot that the owner is rewriting, so
+// the fields are accessed atomically and the copy is dropped if the CAS on
+// 'top' fails.
+struct task {
+	void (*func)(void *);
+	void *arg;
+	unsigned long *counter;
+};
+
+struct taskq {
+	atomic_long top __attribute__((aligned(CACHELINE)));
+	atomic_long bottom __attribute__((aligned(CACHELINE)));
+	struct task tasks[TASKQ_SIZE];
+};
 
-pthread_t kthreads[NBKTHREADS-1];
+
+// A kernel thread and its local run queues, one deque per priority level.
+struct kthread {
+	int id;
+	pthread_t pth;
+	unsigned int seed;  // victim selection
+	unsigned int tick;  // yields since the last forced steal
+	unsigned long clock; // queue scans, queued jobs age with it
+
+	// stacks ready to be reused, private to the kthread, all of 'stackssize'
+	void *stacks[STACK_CACHE_SIZE];
+	int nbstacks;
+	size_t stackssize;
+	unsigned int stackcolor;
+
+	// preemption: 'inlib' is set while the kthread runs its own loop, the
+	// timer handler leaves it alone then (threads have a count of their own,
+	// see _lib_enter). 'nswitch' counts the context switches, a thread is
+	// preempted only if it has been running for a whole timeslice.
+	pid_t tid;
+	timer_t timer;
+	atomic_int hastimer;
+	volatile int inlib;
+	unsigned long nswitch;
+	unsigned long tickswitch;
+
+	// free thread descriptors whose home is this kthread: the local list is
+	// private, the remote one is filled by the other kthreads
+	struct thread *freethreads;
+	struct thread *_Atomic remotefree __attribute__((aligned(CACHELINE)));
+
+	// threads created for this kthread by another one (thread_attr_setkthread),
+	// pushed by anyone, popped by the owner only
+	struct thread *_Atomic inbox __attribute__((aligned(CACHELINE)));
+
+	// bit l is set when rq[l] may not be empty. Only the owner writes it: it
+	// sets the bit before pushing and clears it once it sees the deque empty.
+	atomic_uint levels __attribute__((aligned(CACHELINE)));
+	struct deque rq[PRIO_LEVELS];
+
+	// stackless tasks, run by the kthread loop between two threads
+	struct taskq tq;
+
+	// threads created and threads exited on this kthread, see _last_exited
+	atomic_ulong nbcreated __attribute__((aligned(CACHELINE)));
+	atomic_ulong nbexited;
+} __attribute__((aligned(CACHELINE)));
+
+// The pool is sized at run time (see __init and thread_setconcurrency). It can
+// only grow: kthreads[i] never changes once nbkthreads > i.
+static struct kthread *kthreads[MAX_KTHREADS];
+static atomic_int nbkthreads;
+static pthread_mutex_t kthreadsmtx = PTHREAD_MUTEX_INITIALIZER;
+
+// kthread i is pinned on pincpus[i % nbpincpus], unless nbpincpus is 0
+static int pincpus[MAX_KTHREADS];
+static int nbpincpus;
+
+
+#define CLAIM_NONE   0 // never ran
+#define CLAIM_KTHREAD 1 // started by a kthread
+#define CLAIM_JOINER 2 // run inline by its joiner
+#define CLAIM_CANCEL 3 // finished by thread_cancel before it ever ran
+#define CLAIM_SWITCH 4 // started by its joiner or creator, switching to it
+
+#define RUN_READY     0 // switched out, queued or about to be
+#define RUN_RUNNING   1 // owned by a kthread (or by its creator, until queued)
+#define RUN_SWITCHING 2 // switching out, its context is not saved yet
+#define RUN_BLOCKED   3 // switched out, waiting for _wake
+#define RUN_WAKING    4 // woken up before it was switched out
+#define RUN_DONE      5 // finished and switched out, may be reclaimed
+
+
+// plain int so that it can be embedded in the public thread_mutex_t and
+// thread_cond_t
+typedef int spinlock_t;
 
 
 struct thread {
-	ucontext_t uc, *uc_prev;
+	context_t uc, *uc_prev;
+	void *stack;
+
+	void *(*func)(void *);
+	void *funcarg;
+	size_t argtop; // stack top bytes holding a thread_create_copy argument
 
 	char isdone;
 	void *retval;
+	int run;          // RUN_*, who owns the thread and its context
+
+	// threads blocked in thread_join on this one, linked through 'threads'
+	struct threadqueue waiters;
+	spinlock_t lock;  // protects retval, waiters, detached and RUN_DONE
+	char isblocked;   // switched out, but not to be queued again
+	size_t stacksize; // usable size, the guard page excluded
+	char bound;       // stack and context set up, done when it first runs
+	char userstack;   // stack provided by thread_attr_setstack, not ours
+	char detached;    // reclaimed by the scheduler as soon as it is done
+
+	// a thread that never ran may be run inline by its joiner (_join_inline)
+	char claimed;        // CLAIM_*, taken by a kthread or by the joiner
+	char indeque;        // first queued on a deque, not through 'threads'
+	char stale;          // inlined: the first queue entry is to be dropped
+	int refs;            // inlined: the owner and the stale queue entry,
+	                     // or the creator it was switched to by
+	jmp_buf *inlinejmp;  // thread_exit of an inlined thread returns there
+
+	int prio;              // THREAD_PRIO_MIN..THREAD_PRIO_MAX
+	unsigned long readyat; // clock of the kthread it was queued on
+
+	volatile int inlib;  // _lib_enter nesting, 1 while switched out
+	int nopreempt;       // thread_preempt_disable nesting
+	char preemptpending; // a preemption was deferred by thread_preempt_disable
+
+	struct thread *nextwait; // mutex and condition variable wait queues, inbox
+	thread_mutex_t *waitmutex; // mutex to take back after thread_cond_wait
+	thread_cond_t *waitcond;   // queued on it, cleared by whoever dequeues us
 
         int state;
         int canceled;
+	struct thread *joining; // in thread_join on it, cleared by whoever wakes us
+	thread_group_t *waitgroup; // in thread_group_wait on it, same
+	struct thread_cleanup *cleanup; // innermost thread_cleanup_push
+
+	thread_group_t *group;     // counted in it until _finish
+	struct thread *groupnext;  // pending members, under the group lock
+	struct thread **groupprev; // NULL once out of the list
 
 	struct thread *caller;  // points to the thread that called swapcontext
 
-	TAILQ_ENTRY(thread) threads;
+	TAILQ_ENTRY(thread) threads; // ready queue or wait queue
+
+	int home;                 // kthread owning the descriptor's slab, or -1
+	struct thread *nextfree;  // free list link
 
-	pthread_mutex_t mtx;
 	int valgrind_stackid;
 
+	// a small thread_create_copy argument lives here, funcarg points to it
+	char argbuf[ARG_INLINE_SIZE] __attribute__((aligned(16)));
+
 	// NOTE:
-	// * When run, a thread will attempt to unlock whatever is pointed by
-	// caller. Make sure to set this to NULL if the swapcontext is done from
-	// the stack of a kernel thread as opposed to the stack of a context. If
-	// the swapcontext is done from another thread's context, make it point to
-	// that thread.
+	// * When run, a thread will release whatever is pointed by caller. Make
+	// sure to set this to NULL if the swapcontext is done from the stack of a
+	// kernel thread as opposed to the stack of a context. If the swapcontext
+	// is done from another thread's context, make it point to that thread.
+	// * A thread is resumed by whoever moves it from RUN_READY to RUN_RUNNING.
+	// It goes through RUN_SWITCHING while its context is being saved, and
+	// _release, run on the next context, then makes it RUN_READY, RUN_BLOCKED
+	// or RUN_DONE. Whoever wakes a blocked thread up moves it from RUN_BLOCKED
+	// to RUN_READY and hands it to _add_job, or leaves RUN_WAKING for _release
+	// if it is not switched out yet.
 };
 
 
 static pthread_key_t key_self;
+static pthread_key_t key_kthread;
 static struct thread *_mainth;
 
-static sem_t nbready;
-static unsigned int thcount = 1; // one thread at start time
-static pthread_mutex_t thcountmtx = PTHREAD_MUTEX_INITIALIZER;
-
-static TAILQ_HEAD(threadqueue, thread) ready;
+// Idle kthreads first spin on the queues, then sleep on the 'idleseq' futex.
+// An enqueuer only wakes one of them up when nobody is spinning already.
+static atomic_int nbspinning;
+static atomic_int nbsleeping;
+static atomic_int idleseq;
+static atomic_uint idlespin = IDLE_SPIN;
+
+static atomic_uint timeslice; // in microseconds, 0 disables preemption
+static atomic_uint spawnbacklog = SPAWN_BACKLOG; // 0 never runs thread_create inline
+// threads created and exited outside of the library kthreads
+static atomic_ulong extcreated;
+static atomic_ulong extexited;
+static atomic_int terminating; // set by the thread that calls exit()
+
+// Overflow and injection queues, one per priority level: receive jobs when a
+// local deque is full or when they are enqueued from a kernel thread the
+// library did not create.
+static struct threadqueue ready[PRIO_LEVELS];
 static pthread_mutex_t readymtx = PTHREAD_MUTEX_INITIALIZER;
+static atomic_uint nbinjected; // length of 'ready', read without the lock
+
+// Spill pool for the stacks that do not fit in the kthread caches. The pooled
+// stacks are chained through a pointer stored in their top word. Only stacks
+// of the default size (thread_setstacksize) are cached and pooled, the caches
+// and the pool are emptied when it changes.
+static size_t pagesize;
+static size_t stacksize = CONTEXT_STACK_SIZE; // for the threads to be created
+static void *stackpool;
+static unsigned int nbpooled;
+static size_t poolsize; // size of the pooled stacks
+static pthread_mutex_t stackpoolmtx = PTHREAD_MUTEX_INITIALIZER;
 
 
 /******************************************/
 /*       SOME UTILITY FUNCTIONS           */
 /******************************************/
-struct thread *_thread_new(void)
+// for very short critical sections only
+static inline void _spin_lock(spinlock_t *l)
 {
-	struct thread *t;
-
-	t = malloc(sizeof *t);
-
-	if (NULL == t) {
-		perror("malloc");
-		return NULL;
+	while (__atomic_exchange_n(l, 1, __ATOMIC_ACQUIRE)) {
+		CPU_RELAX();
 	}
+}
 
-	t->isdone = 0;
-	t->state = THREAD_CANCEL_ENABLE;
-	t->canceled = 0;
-	t->caller = NULL;
-	t->retval = NULL;
-	t->uc_prev = NULL;
-	t->uc.uc_link = NULL;
-
-	pthread_mutex_init(&t->mtx, NULL);
-	pthread_mutex_lock(&t->mtx);
 
-	return t;
+static inline void _spin_unlock(spinlock_t *l)
+{
+	__atomic_store_n(l, 0, __ATOMIC_RELEASE);
 }
 
 
-static void _add_job(struct thread *t)
+static inline struct kthread *_kthread_self(void)
 {
-	if (0 == t->canceled || THREAD_CANCEL_DISABLE == t->state)
-	{
-		pthread_mutex_lock(&readymtx);
-		TAILQ_INSERT_TAIL(&ready, t, threads);
-		pthread_mutex_unlock(&t->mtx);
-		pthread_mutex_unlock(&readymtx);
-		
-		sem_post(&nbready);
-		
-	} else {
+	return pthread_getspecific(key_kthread);
+}
 
-		t->isdone = 0;
-		t->retval = NULL;
 
-		pthread_mutex_lock(&thcountmtx);
-		thcount--;
-		pthread_mutex_unlock(&thcountmtx);
+// Every public function that touches the scheduler is bracketed by these two
+// so that the preemption handler never interrupts library code. The count
+// belongs to the thread, not to the kthread: a preemption between reading the
+// kthread and updating its count could migrate the thread, which would then
+// update the count of a kthread it no longer runs on. The handler never
+// changes the count of the thread it interrupts, an interrupted increment
+// stays right.
+static inline void _lib_enter(void)
+{
+	struct thread *self = pthread_getspecific(key_self);
 
-		if (t != _mainth) {
-			// libérer ressource
-			VALGRIND_STACK_DEREGISTER(t->valgrind_stackid);
-			free(t->uc.uc_stack.ss_sp);
-			pthread_mutex_unlock(&t->mtx);
-			free(t);
-		} else {
-			// special case for the main t (see __destroy)
-			pthread_mutex_unlock(&t->mtx);
-			free(t);
-			_mainth = NULL;
-		}
+	if (self) {
+		self->inlib++;
+		atomic_signal_fence(memory_order_seq_cst);
 	}
 }
 
 
-static struct thread *_get_job(void)
+static inline void _lib_leave(void)
 {
-	struct thread *t;
+	struct thread *self = pthread_getspecific(key_self);
 
-	pthread_mutex_lock(&readymtx);
-	if (NULL != (t = TAILQ_FIRST(&ready))) {
-		assert(!t->isdone);
-		TAILQ_REMOVE(&ready, t, threads);
-		pthread_mutex_lock(&t->mtx);
+	if (self) {
+		atomic_signal_fence(memory_order_seq_cst);
+		self->inlib--;
 	}
-	pthread_mutex_unlock(&readymtx);
-
-	return t;
 }
 
 
-// Threads MUST call this function instead of swapcontext
-static int _magicswap(struct thread *self, struct thread *th)
+// Cancellation is deferred: a cancelled thread only exits at the cancellation
+// points, which test this outside of the library (thread_exit enters it).
+static inline int _cancelpending(struct thread *self)
 {
-	int rv = 0;
+	return __atomic_load_n(&self->canceled, __ATOMIC_SEQ_CST)
+		&& THREAD_CANCEL_ENABLE == self->state;
+}
 
-	{ /* in the calling thread */
-		assert(th);
-		assert(!th->isdone);
 
-#ifdef SWAPINFO
-		fprintf(stderr, "* Magicswap in (tid %ld) %p --> %p\n",
-				GETTID, self, th);
-#endif
+static inline void _testcancel(struct thread *self)
+{
+	if (__builtin_expect(_cancelpending(self), 0)) {
+		thread_exit(THREAD_CANCELED);
+	}
+}
 
-		// init next job
-		th->caller = self;
-		th->uc_prev = self->uc_prev;
 
-		pthread_setspecific(key_self, th);
+// Descriptors are carved from slabs of SLAB_SIZE and never given back to
+// malloc: a freed descriptor returns to the free list of its home kthread,
+// directly if freed there, through the lock-free 'remotefree' stack
+// otherwise. Descriptors allocated outside of the library kthreads have no
+// home and go through malloc.
+static struct thread *_thread_alloc(void)
+{
+	int i;
+	struct thread *t, *slab;
+	struct kthread *kt = _kthread_self();
+
+	if (NULL == kt) {
+		if (NULL == (t = malloc(sizeof *t))) {
+			perror("malloc");
+			return NULL;
+		}
+		t->home = -1;
+		t->lock = 0;
+		return t;
 	}
 
-	// POOF 
-	swapcontext(&self->uc, &th->uc);
+	if (NULL == kt->freethreads) {
+		kt->freethreads = atomic_exchange_explicit(&kt->remotefree, NULL,
+				memory_order_acquire);
+	}
 
-	//if (rv) {
-	//	perror("swapcontext");
-	//}
+	if (NULL == kt->freethreads) {
+		if (posix_memalign((void **)&slab, CACHELINE, SLAB_SIZE * sizeof *slab)) {
+			perror("posix_memalign");
+			return NULL;
+		}
 
-	{ /* in some thread, we don't know who we are yet */
-		struct thread *caller, *called;
+		for (i = 0; i < SLAB_SIZE; i++) {
+			slab[i].home = kt->id;
+			slab[i].nextfree = (i+1 < SLAB_SIZE) ? &slab[i+1] : NULL;
+			slab[i].lock = 0;
+		}
+		kt->freethreads = slab;
+	}
 
-		// release the thread that called swap
-		called = thread_self();
-		caller = called->caller;
+	t = kt->freethreads;
+	kt->freethreads = t->nextfree;
 
-		assert(!called->isdone);
+	return t;
+}
 
-#ifdef SWAPINFO
-		fprintf(stderr, "* Magicswap out (tid %ld) now in %p\n",
-				GETTID, called);
-#endif
 
-		// caller may be NULL in the following scenario:
-		// th1 calls _magicswap and goes to sleep when calling swapcontext. It
-		// is then unlocked by th2 which he called. th2 adds th1 to the job
-		// queue. A thread that falled back to _clone_func dequeue th1 and
-		// resumes it.
-		if (caller) {
-#ifdef SWAPINFO
-			fprintf(stderr, "* releasing caller from Magicswap %p\n", caller);
-#endif
-			if (!caller->isdone) {
-				// add job will unlock the caller
-				_add_job(caller);
-			} else {
-				pthread_mutex_unlock(&caller->mtx);
-			}
-		}
+static void _thread_free(struct thread *t)
+{
+	struct kthread *home, *kt = _kthread_self();
+
+	if (-1 == t->home) {
+		free(t);
+		return;
 	}
 
-	return rv;
+	home = kthreads[t->home];
+	if (home == kt) {
+		t->nextfree = kt->freethreads;
+		kt->freethreads = t;
+	} else {
+		t->nextfree = atomic_load_explicit(&home->remotefree,
+				memory_order_relaxed);
+		while (!atomic_compare_exchange_weak_explicit(&home->remotefree,
+					&t->nextfree, t,
+					memory_order_release, memory_order_relaxed));
+	}
 }
 
 
-static void * _clone_func(void *arg)
+struct thread *_thread_new(void)
 {
-	ucontext_t uc;
 	struct thread *t;
 
-	// main loop
-	while (1) {
-		// release the job that called us if any
-		t = thread_self();
-		if (t) {
-#ifdef SWAPINFO
-			fprintf(stderr, "* unlock from _clone_func %p\n", t);
-#endif
-			if (!t->isdone) {
-				_add_job(t);
-			} else {
-				pthread_mutex_unlock(&t->mtx);
-			}
-		}
+	if (NULL == (t = _thread_alloc())) {
+		return NULL;
+	}
 
-		// get a new job
-		sem_wait(&nbready);
-		t = _get_job();
-		assert(t != NULL);
-		assert(!t->isdone);
+	t->isdone = 0;
+	t->state = THREAD_CANCEL_ENABLE;
+	t->canceled = 0;
+	t->joining = NULL;
+	t->waitgroup = NULL;
+	t->waitcond = NULL;
+	t->cleanup = NULL;
+	t->group = NULL;
+	t->groupprev = NULL;
+	t->caller = NULL;
+	t->retval = NULL;
+	t->uc_prev = NULL;
+	t->stack = NULL;
+	t->argtop = 0;
+	t->isblocked = 0;
+	t->run = RUN_RUNNING; // owned by its creator until it is queued
+	t->bound = 0;
+	t->userstack = 0;
+	t->detached = 0;
+	t->claimed = CLAIM_NONE;
+	t->indeque = 0;
+	t->stale = 0;
+	t->refs = 0;
+	t->inlinejmp = NULL;
+	t->inlib = 1; // until _run leaves the library
+	t->nopreempt = 0;
+	t->preemptpending = 0;
+	t->prio = thread_self() ? thread_self()->prio : THREAD_PRIO_DEFAULT;
+	TAILQ_INIT(&t->waiters);
 
-		// swap
-		t->uc_prev = &uc;
-		t->caller = NULL;
+	return t;
+}
 
-		// update 'self' thread
-		pthread_setspecific(key_self, t);
 
-		swapcontext(&uc, &t->uc);
+/******************************************/
+/*       LOCAL RUN QUEUES                 */
+/******************************************/
+// returns -1 if the deque is full
+static int _deque_push(struct deque *q, struct thread *t)
+{
+	long b, top;
+
+	b = atomic_load_explicit(&q->bottom, memory_order_relaxed);
+	top = atomic_load_explicit(&q->top, memory_order_acquire);
+	if (b - top >= DEQUE_SIZE) {
+		return -1;
 	}
 
-	pthread_exit(NULL);
+	atomic_store_explicit(&q->jobs[b & (DEQUE_SIZE-1)], t,
+			memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	atomic_store_explicit(&q->bottom, b+1, memory_order_relaxed);
+
+	return 0;
 }
 
 
-static void _run(void *(*func)(void*), void *funcarg)
+static struct thread *_deque_pop(struct deque *q)
 {
-	struct thread *self, *caller;
+	long b, top;
+	struct thread *t;
 
-	// release the thread that called swap
-	self = thread_self();
-	caller = self->caller;
+	b = atomic_load_explicit(&q->bottom, memory_order_relaxed) - 1;
+	atomic_store_explicit(&q->bottom, b, memory_order_relaxed);
+	atomic_thread_fence(memory_order_seq_cst);
+	top = atomic_load_explicit(&q->top, memory_order_relaxed);
 
-#ifdef SWAPINFO
-	fprintf(stderr, "Job %p started\n", self);
-#endif
+	if (top > b) {
+		// empty
+		atomic_store_explicit(&q->bottom, b+1, memory_order_relaxed);
+		return NULL;
+	}
 
-	if (caller) {
-#ifdef SWAPINFO
-		fprintf(stderr, "* releasing caller from _run %p\n", caller);
-#endif
-		if (!caller->isdone) {
-			// add job will unlock the caller
-			_add_job(caller);
-		} else {
-			pthread_mutex_unlock(&caller->mtx);
+	t = atomic_load_explicit(&q->jobs[b & (DEQUE_SIZE-1)],
+			memory_order_relaxed);
+
+	if (top == b) {
+		// last element: race against thieves
+		if (!atomic_compare_exchange_strong_explicit(&q->top, &top, top+1,
+					memory_order_seq_cst, memory_order_relaxed)) {
+			t = NULL;
 		}
+		atomic_store_explicit(&q->bottom, b+1, memory_order_relaxed);
 	}
 
-	void *retval;
-	retval = func(funcarg);
-	thread_exit(retval);
+	return t;
 }
 
 
-/******************************************/
-/*       CONSTRUCTOR & DESTRUCTOR         */
-/******************************************/
-__attribute__((constructor(101)))
-static void __init()
+// may be called by any kthread, including the owner
+// returns NULL if the deque is empty or if another thief won the race
+static struct thread *_deque_steal(struct deque *q)
 {
-	int i, rv;
-
-	TAILQ_INIT(&ready);
-	sem_init(&nbready, 1, 0);
+	long b, top;
+	struct thread *t;
 
-	// remember which thread started everything
-	maintid = GETTID;
+	top = atomic_load_explicit(&q->top, memory_order_acquire);
+	atomic_thread_fence(memory_order_seq_cst);
+	b = atomic_load_explicit(&q->bottom, memory_order_acquire);
 
-	// add this thread to the list
-	if (NULL == (_mainth = _thread_new())) {
-		exit(EXIT_FAILURE);
+	if (top >= b) {
+		return NULL;
 	}
 
-	getcontext(&_mainth->uc);
-	_mainth->uc_prev = &_mainth->uc;
-
-	// init fallback for the main thread
-	void *stack = malloc(CONTEXT_STACK_SIZE);
-	if (!stack) {
-		perror("malloc");
-		exit(EXIT_FAILURE);
+	t = atomic_load_explicit(&q->jobs[top & (DEQUE_SIZE-1)],
+			memory_order_relaxed);
+	if (!atomic_compare_exchange_strong_explicit(&q->top, &top, top+1,
+				memory_order_seq_cst, memory_order_relaxed)) {
+		return NULL;
 	}
-	getcontext(&mainfallback);
-	mainfallback.uc_stack.ss_sp = stack;
-	mainfallback.uc_stack.ss_size = CONTEXT_STACK_SIZE;
 
-	VALGRIND_STACK_REGISTER(
-		mainfallback.uc_stack.ss_sp,
-		mainfallback.uc_stack.ss_sp
-		+ mainfallback.uc_stack.ss_size
-	);
-	makecontext(&mainfallback, (void (*)(void))_clone_func, 1, NULL);
+	return t;
+}
 
-	// per-thread data
-	pthread_key_create(&key_self, NULL);
-	pthread_setspecific(key_self, _mainth); // 'self' is now _mainth
 
-	// spawn more kernel threads
-	for (i = 0; i < NBKTHREADS-1; i++) {
-		rv = pthread_create(&kthreads[i], NULL, _clone_func, NULL);
+static inline long _deque_size(struct deque *q)
+{
+	return atomic_load_explicit(&q->bottom, memory_order_relaxed)
+		- atomic_load_explicit(&q->top, memory_order_relaxed);
+}
 
-		if (rv != 0) {
-			perror("pthread_create");
-			exit(EXIT_FAILURE);
-		}
 
-		pthread_detach(kthreads[i]);
-	}
+static inline int _deque_empty(struct deque *q)
+{
+	return atomic_load_explicit(&q->top, memory_order_acquire)
+		>= atomic_load_explicit(&q->bottom, memory_order_acquire);
 }
 
 
-__attribute__((destructor))
-static void __destroy()
+// Priority a job queued on the owner's deque has reached by aging: the
+// oldest job of a level gains one level every AGING_QUANTUM scans of the
+// kthread. Only an estimate, the job may be stolen meanwhile.
+static int _deque_level(struct kthread *kt, int level)
 {
-	free(mainfallback.uc_stack.ss_sp);
+	long top;
+	struct thread *t;
+	struct deque *q = &kt->rq[level];
 
-	// special case for the main thread that may not be joined or may not call
-	// thread_exit()
-	if (_mainth) {
-		pthread_mutex_unlock(&_mainth->mtx);
-		free(_mainth);
+	top = atomic_load_explicit(&q->top, memory_order_acquire);
+	if (top >= atomic_load_explicit(&q->bottom, memory_order_relaxed)) {
+		return -1;
 	}
-}
 
+	t = atomic_load_explicit(&q->jobs[top & (DEQUE_SIZE-1)],
+			memory_order_relaxed);
+	level += (kt->clock - __atomic_load_n(&t->readyat, __ATOMIC_RELAXED))
+		/ AGING_QUANTUM;
 
-/******************************************/
-/*       IMPLEMENTATION FUNCTIONS         */
-/******************************************/
-thread_t thread_self(void)
-{
-	return pthread_getspecific(key_self);
+	return level < PRIO_LEVELS ? level : THREAD_PRIO_MAX;
 }
 
 
-int thread_create(thread_t *newthread, void *(*func)(void *), void *funcarg)
+// Take a job of priority 'floor' at least from the local queues. The highest
+// level wins, unless the oldest job of a lower level has aged above it.
+static struct thread *_get_local(struct kthread *kt, int fifo, int floor)
 {
-	void *stack;
+	int l, best = -1, bestlevel = floor - 1;
+	unsigned int levels;
+	struct thread *t = NULL;
 
-	if (NULL == (*newthread = _thread_new())){
-		return -1;
-	}
+	kt->clock++;
 
-	stack = malloc(CONTEXT_STACK_SIZE);
-	if (NULL == stack) {
-		perror("malloc");
-		free(*newthread);
-		return -1;
+	levels = atomic_load_explicit(&kt->levels, memory_order_relaxed);
+	if (0 == levels) {
+		return NULL;
 	}
 
-	getcontext(&(*newthread)->uc);
-	(*newthread)->uc.uc_stack.ss_sp = stack;
-	(*newthread)->uc.uc_stack.ss_size = CONTEXT_STACK_SIZE;
+	l = 31 - __builtin_clz(levels);
+	if (levels == (1u << l) && l >= floor) {
+		// common case: a single level in use
+		best = l;
+	} else {
+		for (; l >= 0; l--) {
+			int level;
 
-	(*newthread)->valgrind_stackid =
-		VALGRIND_STACK_REGISTER(
-			(*newthread)->uc.uc_stack.ss_sp,
-			(*newthread)->uc.uc_stack.ss_sp
-			+ (*newthread)->uc.uc_stack.ss_size
-		);
-	
-	makecontext(
-		&(*newthread)->uc, (void (*)(void))_run, 2, func, funcarg
-	);
+			if (!(levels & (1u << l))) {
+				continue;
+			}
+
+			if (-1 == (level = _deque_level(kt, l))) {
+				levels &= ~(1u << l);
+				atomic_store_explicit(&kt->levels, levels,
+						memory_order_relaxed);
+			} else if (level > bestlevel) {
+				best = l;
+				bestlevel = level;
+			}
+		}
+	}
 
-	pthread_mutex_lock(&thcountmtx);
-	thcount++;
-	pthread_mutex_unlock(&thcountmtx);
+	if (-1 == best) {
+		return NULL;
+	}
+
+	// an aged job is the oldest of its level
+	if (fifo || best != 31 - __builtin_clz(levels)) {
+		t = _deque_steal(&kt->rq[best]);
+	} else {
+		t = _deque_pop(&kt->rq[best]);
+	}
 
-	_add_job(*newthread);
+	if (NULL == t && _deque_empty(&kt->rq[best])) {
+		atomic_store_explicit(&kt->levels, levels & ~(1u << best),
+				memory_order_relaxed);
+	}
 
-	return 0;
+	return t;
 }
 
 
-int thread_yield(void)
+// returns -1 if the deque of that level is full
+static int _put_local(struct kthread *kt, struct thread *t, int prio)
 {
-	struct thread *next;
+	unsigned int levels;
 
-	thread_t self = thread_self();
-	assert(self != NULL);
+	levels = atomic_load_explicit(&kt->levels, memory_order_relaxed);
+	if (!(levels & (1u << prio))) {
+		atomic_store_explicit(&kt->levels, levels | (1u << prio),
+				memory_order_relaxed);
+	}
 
-	if (!sem_trywait(&nbready)) {
-		next = _get_job();
-		assert(next != NULL);
-		_magicswap(self, next);
-	} else {
-#ifdef SWAPINFO
+	__atomic_store_n(&t->readyat, kt->clock, __ATOMIC_RELAXED);
+
+	return _deque_push(&kt->rq[prio], t);
+}
+
+
+static void _inbox_push(struct kthread *kt, struct thread *t)
+{
+	t->nextwait = atomic_load_explicit(&kt->inbox, memory_order_relaxed);
+	while (!atomic_compare_exchange_weak_explicit(&kt->inbox, &t->nextwait, t,
+				memory_order_release, memory_order_relaxed));
+}
+
+
+// owner only: pushers never remove anything, so the head can not be popped and
+// pushed again behind our back (no ABA)
+static struct thread *_inbox_pop(struct kthread *kt, int floor)
+{
+	struct thread *t;
+
+	t = atomic_load_explicit(&kt->inbox, memory_order_acquire);
+	do {
+		if (NULL == t || t->prio < floor) {
+			return NULL;
+		}
+	} while (!atomic_compare_exchange_weak_explicit(&kt->inbox, &t,
+				t->nextwait, memory_order_acquire, memory_order_acquire));
+
+	return t;
+}
+
+
+static struct thread *_get_injected(int floor)
+{
+	int l;
+	struct thread *t = NULL;
+
+	if (0 == atomic_load_explicit(&nbinjected, memory_order_relaxed)) {
+		return NULL;
+	}
+
+	pthread_mutex_lock(&readymtx);
+	for (l = THREAD_PRIO_MAX; l >= floor; l--) {
+		if (NULL != (t = TAILQ_FIRST(&ready[l]))) {
+			TAILQ_REMOVE(&ready[l], t, threads);
+			atomic_fetch_sub_explicit(&nbinjected, 1, memory_order_relaxed);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&readymtx);
+
+	return t;
+}
+
+
+// steal the highest priority job of priority 'floor' at least from the other
+// kthreads, starting with a random victim
+static struct thread *_steal_job(struct kthread *kt, int floor)
+{
+	int i, l, first, n;
+	unsigned int levels;
+	struct thread *t;
+
+	n = atomic_load_explicit(&nbkthreads, memory_order_acquire);
+	if (n < 2) {
+		return NULL;
+	}
+
+	first = rand_r(&kt->seed) % n;
+	for (i = 0; i < n; i++) {
+		struct kthread *victim = kthreads[(first + i) % n];
+
+		if (victim == kt) {
+			continue;
+		}
+
+		levels = atomic_load_explicit(&victim->levels, memory_order_acquire);
+		for (l = THREAD_PRIO_MAX; l >= floor; l--) {
+			if ((levels & (1u << l))
+					&& NULL != (t = _deque_steal(&victim->rq[l]))) {
+				return t;
+			}
+		}
+	}
+
+	return NULL;
+}
+
+
+/******************************************/
+/*       POSTED TASKS                     */
+/******************************************/
+static inline void _task_store(struct task *slot, struct task *task)
+{
+	__atomic_store_n(&slot->func, task->func, __ATOMIC_RELAXED);
+	__atomic_store_n(&slot->arg, task->arg, __ATOMIC_RELAXED);
+	__atomic_store_n(&slot->counter, task->counter, __ATOMIC_RELAXED);
+}
+
+
+static inline void _task_load(struct task *slot, struct task *task)
+{
+	task->func = __atomic_load_n(&slot->func, __ATOMIC_RELAXED);
+	task->arg = __atomic_load_n(&slot->arg, __ATOMIC_RELAXED);
+	task->counter = __atomic_load_n(&slot->counter, __ATOMIC_RELAXED);
+}
+
+
+// Same protocol as _deque_push, _deque_pop and _deque_steal, with the task
+// copied in or out of the slot. Push and pop are for the owner only.
+static int _taskq_push(struct taskq *q, struct task *task)
+{
+	long b, top;
+
+	b = atomic_load_explicit(&q->bottom, memory_order_relaxed);
+	top = atomic_load_explicit(&q->top, memory_order_acquire);
+	if (b - top >= TASKQ_SIZE) {
+		return -1;
+	}
+
+	_task_store(&q->tasks[b & (TASKQ_SIZE-1)], task);
+	atomic_thread_fence(memory_order_release);
+	atomic_store_explicit(&q->bottom, b+1, memory_order_relaxed);
+
+	return 0;
+}
+
+
+static int _taskq_pop(struct taskq *q, struct task *task)
+{
+	long b, top;
+	int found = 1;
+
+	b = atomic_load_explicit(&q->bottom, memory_order_relaxed) - 1;
+	atomic_store_explicit(&q->bottom, b, memory_order_relaxed);
+	atomic_thread_fence(memory_order_seq_cst);
+	top = atomic_load_explicit(&q->top, memory_order_relaxed);
+
+	if (top > b) {
+		// empty
+		atomic_store_explicit(&q->bottom, b+1, memory_order_relaxed);
+		return 0;
+	}
+
+	_task_load(&q->tasks[b & (TASKQ_SIZE-1)], task);
+
+	if (top == b) {
+		// last element: race against thieves
+		if (!atomic_compare_exchange_strong_explicit(&q->top, &top, top+1,
+					memory_order_seq_cst, memory_order_relaxed)) {
+			found = 0;
+		}
+		atomic_store_explicit(&q->bottom, b+1, memory_order_relaxed);
+	}
+
+	return found;
+}
+
+
+static int _taskq_steal(struct taskq *q, struct task *task)
+{
+	long b, top;
+
+	top = atomic_load_explicit(&q->top, memory_order_acquire);
+	atomic_thread_fence(memory_order_seq_cst);
+	b = atomic_load_explicit(&q->bottom, memory_order_acquire);
+
+	if (top >= b) {
+		return 0;
+	}
+
+	_task_load(&q->tasks[top & (TASKQ_SIZE-1)], task);
+
+	return atomic_compare_exchange_strong_explicit(&q->top, &top, top+1,
+			memory_order_seq_cst, memory_order_relaxed);
+}
+
+
+static inline int _taskq_empty(struct taskq *q)
+{
+	return atomic_load_explicit(&q->top, memory_order_acquire)
+		>= atomic_load_explicit(&q->bottom, memory_order_acquire);
+}
+
+
+static inline void _task_run(struct task *task)
+{
+	task->func(task->arg);
+	if (task->counter) {
+		__atomic_sub_fetch(task->counter, 1, __ATOMIC_RELEASE);
+	}
+}
+
+
+// Run up to max tasks posted on this kthread, returns how many were run.
+static int _run_tasks(struct kthread *kt, int max)
+{
+	int n;
+	struct task task;
+
+	for (n = 0; n < max && _taskq_pop(&kt->tq, &task); n++) {
+		_task_run(&task);
+	}
+
+	return n;
+}
+
+
+// Run one task, posted on this kthread or stolen from another one. Returns 0
+// if none was found.
+static int _run_one_task(struct kthread *kt)
+{
+	int i, first, n;
+	struct task task;
+
+	if (_taskq_pop(&kt->tq, &task)) {
+		_task_run(&task);
+		return 1;
+	}
+
+	n = atomic_load_explicit(&nbkthreads, memory_order_acquire);
+	first = rand_r(&kt->seed) % n;
+	for (i = 0; i < n; i++) {
+		struct kthread *victim = kthreads[(first + i) % n];
+
+		if (victim != kt && _taskq_steal(&victim->tq, &task)) {
+			_task_run(&task);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+
+static int _tasks_posted(void)
+{
+	int i, n;
+
+	n = atomic_load_explicit(&nbkthreads, memory_order_acquire);
+	for (i = 0; i < n; i++) {
+		if (!_taskq_empty(&kthreads[i]->tq)) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+
+/******************************************/
+/*       STACKS                           */
+/******************************************/
+#define STACK_LINK(stack, size) \
+	(*(void **)((char *)(stack) + (size) - sizeof (void *)))
+
+// A stack is mapped with a PROT_NONE guard page right below it: an overflow
+// faults instead of corrupting whatever lies next. Its pages are committed by
+// the kernel when first touched, so a large stack costs address space only.
+static void *_stack_map(size_t size)
+{
+	char *map;
+
+	map = mmap(NULL, size + pagesize, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK | MAP_NORESERVE, -1, 0);
+	if (MAP_FAILED == map) {
+		perror("mmap");
+		return NULL;
+	}
+
+	if (mprotect(map, pagesize, PROT_NONE)) {
+		perror("mprotect");
+		munmap(map, size + pagesize);
+		return NULL;
+	}
+
+	return map + pagesize;
+}
+
+
+static void _stack_unmap(void *stack, size_t size)
+{
+	if (munmap((char *)stack - pagesize, size + pagesize)) {
+		perror("munmap");
+	}
+}
+
+
+// The default size changed: the cached stacks are of no use any more.
+static void _stack_cache_reset(struct kthread *kt, size_t size)
+{
+	while (kt->nbstacks > 0) {
+		_stack_unmap(kt->stacks[--kt->nbstacks], kt->stackssize);
+	}
+	kt->stackssize = size;
+}
+
+
+// caller must hold stackpoolmtx
+static void _stack_pool_reset(size_t size)
+{
+	void *stack;
+
+	while (NULL != (stack = stackpool)) {
+		stackpool = STACK_LINK(stack, poolsize);
+		_stack_unmap(stack, poolsize);
+	}
+	nbpooled = 0;
+	poolsize = size;
+}
+
+
+// Only stacks of the current default size come from the caches, the others
+// are mapped for the thread alone.
+static void *_stack_alloc(size_t size)
+{
+	void *stack;
+	struct kthread *kt = _kthread_self();
+
+	if (size != __atomic_load_n(&stacksize, __ATOMIC_RELAXED)) {
+		return _stack_map(size);
+	}
+
+	if (kt && kt->stackssize != size) {
+		_stack_cache_reset(kt, size);
+	}
+
+	if (kt && kt->nbstacks > 0) {
+		return kt->stacks[--kt->nbstacks];
+	}
+
+	pthread_mutex_lock(&stackpoolmtx);
+	if (poolsize != size) {
+		_stack_pool_reset(size);
+	}
+	if (kt) {
+		// refill half of the local cache in one go
+		while (stackpool && kt->nbstacks < STACK_CACHE_SIZE/2) {
+			kt->stacks[kt->nbstacks++] = stackpool;
+			stackpool = STACK_LINK(stackpool, size);
+			nbpooled--;
+		}
+		stack = kt->nbstacks > 0 ? kt->stacks[--kt->nbstacks] : NULL;
+	} else if (NULL != (stack = stackpool)) {
+		stackpool = STACK_LINK(stack, size);
+		nbpooled--;
+	}
+	pthread_mutex_unlock(&stackpoolmtx);
+
+	if (stack) {
+		return stack;
+	}
+
+	return _stack_map(size);
+}
+
+
+// caller must hold stackpoolmtx
+static void _stack_spill(void *stack)
+{
+	if (++nbpooled > STACK_POOL_MAX) {
+		// the link lives in the last page, keep it
+		madvise(stack, poolsize - pagesize, MADV_FREE);
+	}
+	STACK_LINK(stack, poolsize) = stackpool;
+	stackpool = stack;
+}
+
+
+static void _stack_free(void *stack, size_t size)
+{
+	struct kthread *kt = _kthread_self();
+
+	if (size != __atomic_load_n(&stacksize, __ATOMIC_RELAXED)) {
+		_stack_unmap(stack, size);
+		return;
+	}
+
+	if (kt && kt->stackssize != size) {
+		_stack_cache_reset(kt, size);
+	}
+
+	if (kt && kt->nbstacks < STACK_CACHE_SIZE) {
+		kt->stacks[kt->nbstacks++] = stack;
+		return;
+	}
+
+	pthread_mutex_lock(&stackpoolmtx);
+	if (poolsize != size) {
+		_stack_pool_reset(size);
+	}
+	if (kt) {
+		// spill half of the local cache in one go
+		while (kt->nbstacks > STACK_CACHE_SIZE/2) {
+			_stack_spill(kt->stacks[--kt->nbstacks]);
+		}
+		kt->stacks[kt->nbstacks++] = stack;
+	} else {
+		_stack_spill(stack);
+	}
+	pthread_mutex_unlock(&stackpoolmtx);
+}
+
+
+// Usable size of a stack: the top is shifted by a few cache lines, different
+// for each new context, so that the hot frames of thousands of identically
+// aligned stacks do not all map to the same cache sets.
+static size_t _stack_colored_size(size_t size)
+{
+	struct kthread *kt = _kthread_self();
+	unsigned int color = kt ? kt->stackcolor++ % STACK_COLORS : 0;
+
+	return size - color * CACHELINE;
+}
+
+
+/******************************************/
+/*       PREEMPTION                       */
+/******************************************/
+// Each kthread owns a timer on its own CPU clock, so that idle kthreads are
+// never woken up by it. The signal is delivered to that kthread only and its
+// handler switches to the next ready thread right away, on the stack of the
+// preempted one: the whole register state stays in the signal frame and is
+// restored by sigreturn when the thread is resumed.
+//
+// Library code is never preempted (see _lib_enter). User code calling
+// functions that are not async-signal-safe, malloc and stdio in particular,
+// must be protected with thread_preempt_disable/enable.
+
+static void _kthread_timer_arm(struct kthread *kt, unsigned int usec)
+{
+	struct itimerspec its;
+
+	its.it_interval.tv_sec = usec / 1000000;
+	its.it_interval.tv_nsec = (usec % 1000000) * 1000;
+	its.it_value = its.it_interval;
+
+	if (timer_settime(kt->timer, 0, &its, NULL)) {
+		perror("timer_settime");
+	}
+}
+
+
+// called by each kthread for itself
+static void _kthread_timer_init(struct kthread *kt)
+{
+	clockid_t clock;
+	struct sigevent sev;
+	unsigned int usec;
+
+	if (atomic_load(&kt->hastimer)) {
+		// the main fallback restarts _clone_func every time
+		return;
+	}
+
+	kt->tid = GETTID;
+	if (pthread_getcpuclockid(pthread_self(), &clock)) {
+		clock = CLOCK_MONOTONIC;
+	}
+
+	memset(&sev, 0, sizeof sev);
+	sev.sigev_notify = SIGEV_THREAD_ID;
+	sev.sigev_signo = PREEMPT_SIGNAL;
+	sev.sigev_notify_thread_id = kt->tid;
+
+	if (timer_create(clock, &sev, &kt->timer)) {
+		perror("timer_create");
+		return;
+	}
+
+	// pairs with thread_settimeslice: either it sees the timer or we see the
+	// new timeslice
+	atomic_store(&kt->hastimer, 1);
+	if (0 != (usec = atomic_load(&timeslice))) {
+		_kthread_timer_arm(kt, usec);
+	}
+}
+
+
+static void _yield(struct thread *self);
+
+static void _preempt_handler(int sig, siginfo_t *info, void *ucontext)
+{
+	int saved_errno;
+	struct thread *self;
+	struct kthread *kt = _kthread_self();
+
+	// the kthread loop, or a thread in the library
+	if (NULL == kt || kt->inlib
+			|| NULL == (self = thread_self()) || self->inlib) {
+		return;
+	}
+
+	if (kt->nswitch != kt->tickswitch) {
+		// the current thread has not used a whole timeslice yet
+		kt->tickswitch = kt->nswitch;
+		return;
+	}
+
+	if (self->nopreempt) {
+		self->preemptpending = 1;
+		return;
+	}
+
+	// not a cancellation point: the thread may be anywhere in its code
+	saved_errno = errno;
+	_yield(self);
+	errno = saved_errno;
+}
+
+
+/******************************************/
+/*       TERMINATION DETECTION            */
+/******************************************/
+// Live threads are not counted in one shared variable: each kthread counts
+// the threads created and the threads exited on it, and only writes its own
+// counters. The counters never decrease.
+static inline void _count_created(void)
+{
+	struct kthread *kt = _kthread_self();
+
+	atomic_fetch_add_explicit(kt ? &kt->nbcreated : &extcreated, 1,
+			memory_order_relaxed);
+}
+
+
+static inline void _count_exited(void)
+{
+	struct kthread *kt = _kthread_self();
+
+	atomic_fetch_add_explicit(kt ? &kt->nbexited : &extexited, 1,
+			memory_order_seq_cst);
+}
+
+
+// Returns 1 if no thread is left, to be called after _count_exited. The exit
+// counters are all read before the creation counters: a thread counted as
+// exited was created before, so it is counted as created too. A thread still
+// alive when its exit counter is read keeps the difference above 0, and so
+// does any thread it created meanwhile. Once the last thread has counted
+// itself out, every scan sees 0: several exiting threads may see it, the
+// caller must elect one of them.
+static int _last_exited(void)
+{
+	int i, n;
+	unsigned long created = 1, exited; // the main thread
+
+	n = atomic_load_explicit(&nbkthreads, memory_order_acquire);
+
+	exited = atomic_load(&extexited);
+	for (i = 0; i < n; i++) {
+		exited += atomic_load(&kthreads[i]->nbexited);
+	}
+
+	created += atomic_load(&extcreated);
+	for (i = 0; i < n; i++) {
+		created += atomic_load(&kthreads[i]->nbcreated);
+	}
+
+	assert(created >= exited);
+	return created == exited;
+}
+
+
+/******************************************/
+/*       SCHEDULING                       */
+/******************************************/
+static inline void _futex_wait(atomic_int *addr, int val)
+{
+	syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+
+static inline void _futex_wake(atomic_int *addr, int n)
+{
+	syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+}
+
+
+// Called after a job has been queued. The fence pairs with the one implied by
+// the nbsleeping increment in _idle: either the sleeper sees the job when it
+// checks the queues one last time, or we see the sleeper.
+static void _wake_idle(void)
+{
+	atomic_thread_fence(memory_order_seq_cst);
+
+	if (0 == atomic_load_explicit(&nbspinning, memory_order_relaxed)
+			&& 0 < atomic_load_explicit(&nbsleeping, memory_order_relaxed)) {
+		atomic_fetch_add(&idleseq, 1);
+		_futex_wake(&idleseq, 1);
+	}
+}
+
+
+// Queue a thread created for another kthread. The target may sleep and
+// _wake_idle only wakes one sleeper, any of them: wake them all, this is rare.
+static void _post_job(struct kthread *kt, struct thread *t)
+{
+	__atomic_store_n(&t->run, RUN_READY, __ATOMIC_RELEASE);
+	_inbox_push(kt, t);
+
+	atomic_thread_fence(memory_order_seq_cst);
+	if (0 < atomic_load_explicit(&nbsleeping, memory_order_relaxed)) {
+		atomic_fetch_add(&idleseq, 1);
+		_futex_wake(&idleseq, INT_MAX);
+	}
+}
+
+
+// Give the stack and the descriptor of a finished thread back to the caches.
+static void _thread_unbind(struct thread *t)
+{
+	VALGRIND_STACK_DEREGISTER(t->valgrind_stackid);
+	if (!t->userstack) {
+		_stack_free(t->stack, t->stacksize);
+		t->stack = NULL;
+	}
+	t->bound = 0;
+}
+
+
+static void _thread_reclaim(struct thread *t)
+{
+	if (t->bound) {
+		_thread_unbind(t);
+	}
+	_thread_free(t);
+}
+
+
+static void _add_job(struct thread *t)
+{
+	struct kthread *kt = _kthread_self();
+	int prio = __atomic_load_n(&t->prio, __ATOMIC_RELAXED);
+
+	__atomic_store_n(&t->run, RUN_READY, __ATOMIC_RELEASE);
+	t->indeque = 1;
+	if (NULL == kt || _put_local(kt, t, prio)) {
+		t->indeque = 0;
+		pthread_mutex_lock(&readymtx);
+		TAILQ_INSERT_TAIL(&ready[prio], t, threads);
+		atomic_fetch_add_explicit(&nbinjected, 1, memory_order_relaxed);
+		pthread_mutex_unlock(&readymtx);
+	}
+
+	_wake_idle();
+}
+
+
+// The current thread is about to be switched out. A _wake that came first
+// has left RUN_WAKING instead of RUN_RUNNING, which stays for _release.
+static inline void _switching(struct thread *self)
+{
+	int s = RUN_RUNNING;
+
+	__atomic_compare_exchange_n(&self->run, &s, RUN_SWITCHING, 0,
+			__ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+
+// Take ownership of a thread popped from a queue. It is RUN_READY already,
+// unless its creator is still in _add_job.
+static inline void _take(struct thread *t)
+{
+	int s = RUN_READY;
+
+	while (!__atomic_compare_exchange_n(&t->run, &s, RUN_RUNNING, 0,
+				__ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+		assert(RUN_RUNNING == s);
+		s = RUN_READY;
+		CPU_RELAX();
+	}
+}
+
+
+// Make a blocked thread runnable again. If it is not switched out yet, we
+// leave that to _release instead of waiting for it.
+static void _wake(struct thread *t)
+{
+	int s = RUN_BLOCKED;
+
+	while (!__atomic_compare_exchange_n(&t->run, &s, RUN_READY, 0,
+				__ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+		assert(RUN_RUNNING == s || RUN_SWITCHING == s);
+		if (__atomic_compare_exchange_n(&t->run, &s, RUN_WAKING, 0,
+					__ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+			return;
+		}
+		s = RUN_BLOCKED;
+	}
+
+	assert(t->isblocked);
+	t->isblocked = 0;
+	_add_job(t);
+}
+
+
+// A thread blocked in thread_join on t is woken up either by t finishing or by
+// thread_cancel, whichever clears its 'joining' first.
+static inline int _unjoin(struct thread *w, struct thread *t)
+{
+	return __atomic_compare_exchange_n(&w->joining, &t, NULL, 0,
+			__ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+}
+
+
+static inline void _group_unlink(struct thread *t)
+{
+	if (t->groupnext) {
+		t->groupnext->groupprev = t->groupprev;
+	}
+	*t->groupprev = t->groupnext;
+	t->groupprev = NULL;
+}
+
+
+// A thread blocked in thread_group_wait is woken up either by the last member
+// of the group or by thread_cancel, whichever clears its 'waitgroup' first.
+static inline int _ungroup(struct thread *w, thread_group_t *g)
+{
+	return __atomic_compare_exchange_n(&w->waitgroup, &g, NULL, 0,
+			__ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+}
+
+
+// A member of a group is done: the last one wakes thread_group_wait up. The
+// group may be gone as soon as its lock is released.
+static void _group_leave(struct thread *t)
+{
+	struct thread *w = NULL;
+	thread_group_t *g = t->group;
+
+	_spin_lock(&g->lock);
+	if (t->groupprev) {
+		_group_unlink(t);
+	}
+	if (0 == --g->count && NULL != (w = g->waiter)) {
+		// a cancelled waiter clears 'waiter' itself before going away
+		g->waiter = NULL;
+		if (!_ungroup(w, g)) {
+			w = NULL;
+		}
+	}
+	_spin_unlock(&g->lock);
+
+	t->group = NULL;
+	if (w) {
+		_wake(w);
+	}
+}
+
+
+// Make a thread that is off its stack RUN_DONE and wake its joiners up.
+// Returns 1 if it is detached, the caller then frees it.
+static int _finish(struct thread *t)
+{
+	int reclaim;
+	struct thread *w;
+	struct threadqueue waiters;
+
+	if (t->group) {
+		_group_leave(t);
+	}
+
+	TAILQ_INIT(&waiters);
+
+	// the joiners and thread_detach may take it from now on
+	_spin_lock(&t->lock);
+	__atomic_store_n(&t->run, RUN_DONE, __ATOMIC_RELEASE);
+	reclaim = t->detached;
+	while (NULL != (w = TAILQ_FIRST(&t->waiters))) {
+		TAILQ_REMOVE(&t->waiters, w, threads);
+		if (_unjoin(w, t)) {
+			TAILQ_INSERT_TAIL(&waiters, w, threads);
+		}
+	}
+	_spin_unlock(&t->lock);
+
+	while (NULL != (w = TAILQ_FIRST(&waiters))) {
+		TAILQ_REMOVE(&waiters, w, threads);
+		_wake(w);
+	}
+
+	return reclaim;
+}
+
+
+// A thread gets its stack and context when it is about to run for the first
+// time, from the cache of the kthread that runs it: a queued thread costs its
+// descriptor only.
+static void _run(void *arg);
+
+// returns -1 if the stack can not be allocated. It may have been allocated
+// already by the caller.
+static int _thread_bind(struct thread *t)
+{
+	size_t size;
+
+	if (!t->userstack && NULL == t->stack
+			&& NULL == (t->stack = _stack_alloc(t->stacksize))) {
+		return -1;
+	}
+
+	t->valgrind_stackid =
+		VALGRIND_STACK_REGISTER(t->stack, t->stack + t->stacksize);
+
+	// the context starts below the argument copied at the stack top, if any
+	size = t->stacksize - t->argtop;
+	context_make(&t->uc, t->stack,
+			t->userstack ? size : _stack_colored_size(size), _run, t);
+
+	t->bound = 1;
+	return 0;
+}
+
+
+// Look once through all the queues for a job of priority 'floor' at least,
+// returns NULL if none was found. Priorities are honoured queue by queue: the
+// local queues first, then the injected ones, then the other kthreads'.
+//
+// fifo = 0: take the most recently queued local job (better cache locality).
+// fifo = 1: take the oldest one, used by thread_yield so that yielding threads
+// do round-robin instead of ping-ponging at the bottom of the deque.
+static struct thread *_find_job(struct kthread *kt, int fifo, int floor)
+{
+	struct thread *t = NULL;
+
+	if (fifo && ++kt->tick >= STEAL_TICK) {
+		// do not let local yielders starve jobs queued elsewhere
+		kt->tick = 0;
+		if (NULL == (t = _get_injected(floor))) {
+			t = _steal_job(kt, floor);
+		}
+	}
+
+	if (NULL == t && atomic_load_explicit(&kt->inbox, memory_order_relaxed)) {
+		t = _inbox_pop(kt, floor);
+	}
+
+	if (NULL == t) {
+		t = _get_local(kt, fifo, floor);
+	}
+
+	if (NULL == t) {
+		t = _get_injected(floor);
+	}
+
+	if (NULL == t) {
+		t = _steal_job(kt, floor);
+	}
+
+	return t;
+}
+
+
+// Drop a reference to a thread run inline by its joiner or finished by
+// thread_cancel, the last one frees the descriptor.
+static void _thread_unref(struct thread *t)
+{
+	if (2 == __atomic_add_fetch(&t->refs, 1, __ATOMIC_ACQ_REL)) {
+		_thread_free(t);
+	}
+}
+
+
+// Claim a thread taken from a queue. Returns 0 if it was the entry left
+// behind by _join_inline or thread_cancel, which is then dropped.
+static int _claim(struct thread *t)
+{
+	char c = CLAIM_NONE;
+
+	if (__atomic_compare_exchange_n(&t->claimed, &c, CLAIM_KTHREAD, 0,
+				__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)
+			|| CLAIM_KTHREAD == c
+			|| !__atomic_exchange_n(&t->stale, 0, __ATOMIC_ACQ_REL)) {
+		return 1;
+	}
+
+	// the entries of an inlined thread are all alike, dropping any one of
+	// them will do
+	_thread_unref(t);
+	return 0;
+}
+
+
+// Take ownership of a claimed thread, binding its stack if it never ran.
+// Returns -1 if there is no memory left for its stack, too late to report it
+// to thread_create: the caller queues it again with _requeue.
+static int _take_job(struct thread *t)
+{
+	assert(!t->isdone);
+	_take(t);
+
+	return (!t->bound && _thread_bind(t)) ? -1 : 0;
+}
+
+
+// Queue a claimed thread that could not get its stack again, behind the other
+// jobs and without waking anybody up: it is retried once running threads give
+// their stacks back.
+static void _requeue(struct thread *t)
+{
+	int prio = __atomic_load_n(&t->prio, __ATOMIC_RELAXED);
+
+	__atomic_store_n(&t->run, RUN_READY, __ATOMIC_RELEASE);
+	t->indeque = 0;
+	pthread_mutex_lock(&readymtx);
+	TAILQ_INSERT_TAIL(&ready[prio], t, threads);
+	atomic_fetch_add_explicit(&nbinjected, 1, memory_order_relaxed);
+	pthread_mutex_unlock(&readymtx);
+}
+
+
+// Get a job and take it. Once a stack could not be allocated, the threads
+// that never ran are set aside until one that has its stack already is found.
+static struct thread *_get_job(int fifo, int floor)
+{
+	struct thread *t, *n;
+	struct threadqueue nostack;
+	struct kthread *kt = _kthread_self();
+
+	assert(kt != NULL);
+
+	TAILQ_INIT(&nostack);
+	while (NULL != (t = _find_job(kt, fifo, floor))) {
+		if (!_claim(t)) {
+			continue;
+		}
+		if ((TAILQ_EMPTY(&nostack) || t->bound) && 0 == _take_job(t)) {
+			break;
+		}
+		TAILQ_INSERT_TAIL(&nostack, t, threads);
+	}
+
+	while (NULL != (n = TAILQ_FIRST(&nostack))) {
+		TAILQ_REMOVE(&nostack, n, threads);
+		_requeue(n);
+	}
+
+	return t;
+}
+
+
+// Wait for a job: spin for a while, then sleep. Posted tasks found meanwhile
+// are run, NULL is returned after one of them so that the kthread loop goes
+// back to its own queues.
+static struct thread *_idle(struct kthread *kt)
+{
+	int seq;
+	unsigned int i, spins;
+	struct thread *t;
+
+	while (1) {
+		atomic_fetch_add(&nbspinning, 1);
+
+		spins = atomic_load_explicit(&idlespin, memory_order_relaxed);
+		for (i = 0; i < spins; i++) {
+			t = _get_job(0, THREAD_PRIO_MIN);
+			if (t || _run_one_task(kt)) {
+				// the last spinner leaves: another idle kthread should take
+				// over in case more jobs are coming
+				if (1 == atomic_fetch_sub(&nbspinning, 1)) {
+					_wake_idle();
+				}
+				return t;
+			}
+			CPU_RELAX();
+		}
+
+		atomic_fetch_sub(&nbspinning, 1);
+		atomic_fetch_add(&nbsleeping, 1);
+
+		seq = atomic_load(&idleseq);
+		if (NULL == (t = _get_job(0, THREAD_PRIO_MIN)) && !_tasks_posted()) {
+			_futex_wait(&idleseq, seq);
+		}
+
+		atomic_fetch_sub(&nbsleeping, 1);
+
+		if (t) {
+			return t;
+		}
+	}
+}
+
+
+
+
+// Release a thread that has just been switched out: put it back in the ready
+// queue unless it is done or blocked.
+static void _release(struct thread *t)
+{
+	int s;
+
+	if (t->isdone) {
+		if (t != _mainth) {
+			// only the descriptor is needed until it is joined
+			_thread_unbind(t);
+		}
+
+		if (_finish(t)) {
+			// nobody will join it
+			if (CLAIM_SWITCH == __atomic_load_n(&t->claimed, __ATOMIC_RELAXED)) {
+				// its queue entry may still be around
+				_thread_unref(t);
+			} else {
+				_thread_free(t);
+			}
+		}
+	} else if (t->isblocked) {
+		s = RUN_SWITCHING;
+		if (!__atomic_compare_exchange_n(&t->run, &s, RUN_BLOCKED, 0,
+					__ATOMIC_RELEASE, __ATOMIC_ACQUIRE)) {
+			// _wake came while it was switching out
+			assert(RUN_WAKING == s);
+			t->isblocked = 0;
+			_add_job(t);
+		}
+	} else {
+		_add_job(t);
+	}
+}
+
+
+// Threads MUST call this function instead of context_swap
+static int _magicswap(struct thread *self, struct thread *th)
+{
+	int rv = 0;
+
+	{ /* in the calling thread */
+		assert(th);
+		assert(!th->isdone);
+
+#ifdef SWAPINFO
+		fprintf(stderr, "* Magicswap in (tid %ld) %p --> %p\n",
+				GETTID, self, th);
+#endif
+
+		// init next job
+		th->caller = self;
+		th->uc_prev = self->uc_prev;
+
+		_switching(self);
+		pthread_setspecific(key_self, th);
+		_kthread_self()->nswitch++;
+	}
+
+	// POOF 
+	context_swap(&self->uc, &th->uc);
+
+	//if (rv) {
+	//	perror("context_swap");
+	//}
+
+	{ /* in some thread, we don't know who we are yet */
+		struct thread *caller, *called;
+
+		// release the thread that called swap
+		called = thread_self();
+		caller = called->caller;
+
+		assert(!called->isdone);
+
+#ifdef SWAPINFO
+		fprintf(stderr, "* Magicswap out (tid %ld) now in %p\n",
+				GETTID, called);
+#endif
+
+		// caller may be NULL in the following scenario:
+		// th1 calls _magicswap and goes to sleep when calling swapcontext. It
+		// is then unlocked by th2 which he called. th2 adds th1 to the job
+		// queue. A thread that falled back to _clone_func dequeue th1 and
+		// resumes it.
+		if (caller) {
+#ifdef SWAPINFO
+			fprintf(stderr, "* releasing caller from Magicswap %p\n", caller);
+#endif
+			_release(caller);
+		}
+	}
+
+	return rv;
+}
+
+
+static void * _clone_func(void *arg)
+{
+	context_t uc;
+	struct thread *t;
+	struct kthread *kt = arg;
+
+	pthread_setspecific(key_kthread, kt);
+	kt->inlib = 1;
+	_kthread_timer_init(kt);
+
+	// main loop
+	while (1) {
+		// release the job that called us if any
+		t = thread_self();
+		if (t) {
+#ifdef SWAPINFO
+			fprintf(stderr, "* unlock from _clone_func %p\n", t);
+#endif
+			_release(t);
+			pthread_setspecific(key_self, NULL);
+		}
+
+		// posted tasks run here, between two threads
+		_run_tasks(kt, TASK_BATCH);
+
+		// get a new job
+		if (NULL == (t = _get_job(0, THREAD_PRIO_MIN))
+				&& NULL == (t = _idle(kt))) {
+			continue;
+		}
+		assert(t != NULL);
+		assert(!t->isdone);
+
+		// swap
+		t->uc_prev = &uc;
+		t->caller = NULL;
+
+		// update 'self' thread, switched out inside the library
+		pthread_setspecific(key_self, t);
+		kt->nswitch++;
+		kt->inlib = 0;
+
+		context_swap(&uc, &t->uc);
+
+		// back from a thread that is still 'self' and still in the library
+		kt->inlib = 1;
+	}
+
+	pthread_exit(NULL);
+}
+
+
+static void _run(void *arg)
+{
+	struct thread *self, *caller;
+
+	// release the thread that called swap
+	self = thread_self();
+	caller = self->caller;
+
+#ifdef SWAPINFO
+	fprintf(stderr, "Job %p started\n", self);
+#endif
+
+	if (caller) {
+#ifdef SWAPINFO
+		fprintf(stderr, "* releasing caller from _run %p\n", caller);
+#endif
+		_release(caller);
+	}
+
+	// back to user code
+	_lib_leave();
+	assert(0 == self->inlib);
+
+	// cancelled after it was taken from its queue
+	_testcancel(self);
+
+	void *retval;
+	retval = self->func(self->funcarg);
+	thread_exit(retval);
+}
+
+
+// Switch away from self, which is either done or blocked: run the next ready
+// job or fall back to the kthread loop if there is none. Returns when self is
+// resumed, which never happens if it is done.
+static void _switch_out(struct thread *self)
+{
+	struct thread *next;
+
+	// the kthread loop runs the posted tasks first
+	if (_taskq_empty(&_kthread_self()->tq)
+			&& NULL != (next = _get_job(0, THREAD_PRIO_MIN))) {
+		_magicswap(self, next);
+		return;
+	}
+
+	if (_kthread_self() == kthreads[0]) {
+#ifdef SWAPINFO
+		fprintf(stderr, "MAIN fall back to the infinite loop\n");
+#endif
+		// the fallback restarts from scratch every time: its previous
+		// activation, if any, is never resumed
+		context_make(&mainfallback, mainfallback_stack, FALLBACK_STACK_SIZE,
+				(void (*)(void *))_clone_func, kthreads[0]);
+		_switching(self);
+		context_swap(&self->uc, &mainfallback);
+	} else {
+#ifdef SWAPINFO
+		fprintf(stderr, "CLONE fall back to the infinite loop\n");
+#endif
+		_switching(self);
+		context_swap(&self->uc, self->uc_prev);
+	}
+
+	// resumed either by a kthread loop or by a _magicswap from another thread,
+	// in which case we must release it
+	if (self->caller) {
+		_release(self->caller);
+	}
+}
+
+
+// Fill cpus with the CPUs this process may run on, returns how many there are.
+static int _affinity_cpus(int *cpus, int max)
+{
+	int cpu, n = 0;
+	cpu_set_t set;
+
+	if (sched_getaffinity(0, sizeof set, &set)) {
+		perror("sched_getaffinity");
+		return 1;
+	}
+
+	if (NULL == cpus) {
+		return CPU_COUNT(&set);
+	}
+
+	for (cpu = 0; cpu < CPU_SETSIZE && n < max; cpu++) {
+		if (CPU_ISSET(cpu, &set)) {
+			cpus[n++] = cpu;
+		}
+	}
+
+	return n;
+}
+
+
+// Parse a CPU list such as "0,2,4-7".
+static int _parse_cpus(const char *str, int *cpus, int max)
+{
+	int n = 0;
+	long first, last;
+	char *end;
+
+	while (*str && n < max) {
+		first = last = strtol(str, &end, 10);
+		if (end == str || first < 0) {
+			break;
+		}
+		if ('-' == *end) {
+			str = end + 1;
+			last = strtol(str, &end, 10);
+			if (end == str) {
+				break;
+			}
+		}
+		for (; first <= last && n < max; first++) {
+			cpus[n++] = first;
+		}
+		str = (',' == *end) ? end + 1 : end;
+	}
+
+	return n;
+}
+
+
+static void _kthread_pin(struct kthread *kt)
+{
+	int rv;
+	cpu_set_t set;
+
+	if (0 == nbpincpus) {
+		return;
+	}
+
+	CPU_ZERO(&set);
+	CPU_SET(pincpus[kt->id % nbpincpus], &set);
+
+	rv = pthread_setaffinity_np(kt->pth, sizeof set, &set);
+	if (rv) {
+		fprintf(stderr, "pthread_setaffinity_np: %s\n", strerror(rv));
+	}
+}
+
+
+// Start kthreads until there are n of them. The first one is the calling
+// thread, which must be the main thread.
+static int _kthreads_grow(int n)
+{
+	int i, rv = 0;
+	struct kthread *kt;
+
+	if (n > MAX_KTHREADS) {
+		n = MAX_KTHREADS;
+	}
+
+	pthread_mutex_lock(&kthreadsmtx);
+	for (i = atomic_load(&nbkthreads); i < n; i++) {
+		if (posix_memalign((void **)&kt, CACHELINE, sizeof *kt)) {
+			perror("posix_memalign");
+			rv = -1;
+			break;
+		}
+		memset(kt, 0, sizeof *kt);
+		kt->id = i;
+		kt->seed = maintid + i;
+		kthreads[i] = kt;
+
+		if (0 == i) {
+			kt->pth = pthread_self();
+			pthread_setspecific(key_kthread, kt);
+			_kthread_timer_init(kt);
+		} else {
+			rv = pthread_create(&kt->pth, NULL, _clone_func, kt);
+			if (rv != 0) {
+				fprintf(stderr, "pthread_create: %s\n", strerror(rv));
+				kthreads[i] = NULL;
+				free(kt);
+				rv = -1;
+				break;
+			}
+			pthread_detach(kt->pth);
+		}
+
+		_kthread_pin(kt);
+
+		// thieves may look at it from now on
+		atomic_store_explicit(&nbkthreads, i+1, memory_order_release);
+	}
+	pthread_mutex_unlock(&kthreadsmtx);
+
+	return rv;
+}
+
+
+// Can the current thread run t right away, rather than leave it to the
+// scheduler? Not if a job of higher priority is waiting here.
+static inline int _can_run_now(struct thread *t)
+{
+	unsigned int levels = atomic_load_explicit(&_kthread_self()->levels,
+			memory_order_relaxed);
+
+	return (levels >> t->prio) <= 1;
+}
+
+
+// Can the current thread run t on its stack? Not if what is left of it is
+// smaller than the stack t would get, plus some room for the frames of the
+// inlining. Otherwise t gets its own stack (see _join_switch).
+static int _can_inline(struct thread *self, struct thread *t)
+{
+	char *sp = __builtin_frame_address(0);
+
+	return NULL != self->stack
+		&& (size_t)(sp - (char *)self->stack)
+			>= t->stacksize + INLINE_STACK_MARGIN;
+}
+
+
+// Run t, that never ran and that we own, on our stack without any context
+// switch, then finish it as thread_exit would.
+//
+// The inlined thread is itself while it runs: it may yield, block or migrate
+// to another kthread, the current thread being stuck under it on the same
+// stack. thread_exit returns here.
+static void _run_inline(struct thread *self, struct thread *t)
+{
+	jmp_buf jb;
+
+	// it borrows our stack: nothing to bind nor to free
+	t->stack = self->stack;
+	t->bound = 1;
+	t->userstack = 1;
+	t->uc_prev = self->uc_prev;
+	t->caller = NULL;
+	t->inlinejmp = &jb;
+	pthread_setspecific(key_self, t);
+
+	if (0 == _setjmp(jb)) {
+		_lib_leave();
+		t->retval = t->func(t->funcarg);
+		_lib_enter();
+	}
+
+	// we may have migrated: take the place of the inlined thread
+	self->uc_prev = t->uc_prev;
+	pthread_setspecific(key_self, self);
+	t->inlinejmp = NULL;
+	t->stack = NULL;
+	t->bound = 0;
+	t->userstack = 0;
+
+	// as thread_exit and _release, without the switch. The thread running
+	// it is still there, this is not the last one.
+	t->isdone = 1;
+	_count_exited();
+	_finish(t);
+}
+
+
+// Can the joiner of t take it from its queue? Not if it already runs, was
+// given a stack of its own, or is not on a deque (its 'threads' and 'nextwait'
+// links are in use).
+static inline int _can_join_now(struct thread *t)
+{
+	return !t->bound && !t->userstack
+		&& CLAIM_NONE == __atomic_load_n(&t->claimed, __ATOMIC_RELAXED)
+		&& t->indeque && !t->canceled && _can_run_now(t);
+}
+
+
+// Claim t for its joiner. Its queue entry stays behind, _get_job drops it.
+static int _join_claim(struct thread *t, char claim)
+{
+	char c = CLAIM_NONE;
+
+	// set before the claim: whoever sees the claim sees the stale entry
+	__atomic_store_n(&t->stale, 1, __ATOMIC_RELAXED);
+	if (!__atomic_compare_exchange_n(&t->claimed, &c, claim, 0,
+				__ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+		__atomic_store_n(&t->stale, 0, __ATOMIC_RELAXED);
+		return 0;
+	}
+
+	_take(t);
+	return 1;
+}
+
+
+// Help-first join: run a thread that never started on our stack instead of
+// waiting for it. Returns 0 if it was not possible.
+static int _join_inline(struct thread *self, struct thread *t)
+{
+	if (!_can_join_now(t) || !_can_inline(self, t)
+			|| !_join_claim(t, CLAIM_JOINER)) {
+		return 0;
+	}
+
+	_run_inline(self, t);
+	return 1;
+}
+
+
+// The thread that never started does not fit on our stack: give it its own
+// and switch to it directly, without going through the scheduler. self is
+// already parked as its waiter. Returns 0 if it was not possible, self then
+// has to switch out as usual.
+static int _join_switch(struct thread *self, struct thread *t)
+{
+	void *stack;
+
+	if (!_can_join_now(t)
+			|| NULL == (stack = _stack_alloc(t->stacksize))) {
+		return 0;
+	}
+
+	if (!_join_claim(t, CLAIM_SWITCH)) {
+		_stack_free(stack, t->stacksize);
+		return 0;
+	}
+
+	t->stack = stack;
+	_thread_bind(t);
+	_magicswap(self, t);
+	return 1;
+}
+
+
+// Lazy task creation: when enough work is queued here already, creating one
+// more thread only adds overhead, run it right away instead.
+static int _spawn_lazy(struct thread *t, struct kthread *target)
+{
+	struct thread *self = thread_self();
+	struct kthread *kt = _kthread_self();
+	unsigned int backlog = atomic_load_explicit(&spawnbacklog,
+			memory_order_relaxed);
+
+	return backlog && kt && self && !t->bound && !t->userstack
+		&& (NULL == target || target == kt)
+		&& _deque_size(&kt->rq[t->prio]) >= backlog
+		&& _can_run_now(t);
+}
+
+
+// Run t, that nobody else knows about yet, on our stack.
+static int _spawn_inline(struct thread *self, struct thread *t)
+{
+	if (!_can_inline(self, t)) {
+		return 0;
+	}
+
+	// not for thread_cancel to finish, it runs right away
+	t->claimed = CLAIM_JOINER;
+	_run_inline(self, t);
+	if (t->detached) {
+		_thread_free(t);
+	}
+	return 1;
+}
+
+
+// t does not fit on our stack: give it its own and switch to it directly,
+// parked as its waiter as thread_join would. We hold a reference on t, the
+// one its queue entry holds in _join_switch, so that thread_cancel can wake
+// us up before it is done even if it is detached. Returns 0 if its stack
+// can not be allocated.
+static int _spawn_switch(struct thread *self, struct thread *t)
+{
+	if (_thread_bind(t)) {
+		return 0;
+	}
+
+	t->claimed = CLAIM_SWITCH;
+
+	_spin_lock(&t->lock);
+	self->isblocked = 1;
+	TAILQ_INSERT_TAIL(&t->waiters, self, threads);
+	__atomic_store_n(&self->joining, t, __ATOMIC_SEQ_CST);
+	_spin_unlock(&t->lock);
+
+	_magicswap(self, t);
+
+	// done, or we were cancelled and it goes on without us
+	_thread_unref(t);
+	return 1;
+}
+
+
+// Work-first spawn: the child starts right away on this kthread and the
+// creator goes to the bottom of the local deque, where idle kthreads steal
+// it from the other end. Lower priority children are queued as usual.
+static int _spawn_first(struct thread *t, struct kthread *target)
+{
+	struct thread *self = thread_self();
+	struct kthread *kt = _kthread_self();
+
+	return kt && self && (NULL == target || target == kt)
+		&& __atomic_load_n(&t->prio, __ATOMIC_RELAXED)
+			>= __atomic_load_n(&self->prio, __ATOMIC_RELAXED);
+}
+
+
+// Claim a cancelled thread that never ran, for _cancel_finish. Returns 0 if
+// it is not queued yet, or if it was taken already. As with _join_inline, its
+// queue entry stays behind.
+static int _cancel_claim(struct thread *t)
+{
+	char c = CLAIM_NONE;
+
+	if (CLAIM_NONE != __atomic_load_n(&t->claimed, __ATOMIC_RELAXED)
+			|| RUN_READY != __atomic_load_n(&t->run, __ATOMIC_ACQUIRE)) {
+		return 0;
+	}
+
+	__atomic_store_n(&t->stale, 1, __ATOMIC_RELAXED);
+	if (!__atomic_compare_exchange_n(&t->claimed, &c, CLAIM_CANCEL, 0,
+				__ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+		__atomic_store_n(&t->stale, 0, __ATOMIC_RELAXED);
+		return 0;
+	}
+
+	return 1;
+}
+
+
+// Finish a claimed thread without running it, as thread_exit and _release
+// would.
+static void _cancel_finish(struct thread *t)
+{
+	// bound already if it was given a large argument
+	if (t->bound) {
+		_thread_unbind(t);
+	}
+
+	t->retval = THREAD_CANCELED;
+	t->isdone = 1;
+	_count_exited();
+
+	if (_finish(t)) {
+		_thread_unref(t);
+	}
+}
+
+
+// Wake a cancelled thread up if it is blocked in thread_join: take it out of
+// the waiters. The thread it waits for can not go away before it is joined.
+static void _cancel_join(struct thread *t)
+{
+	struct thread *j = __atomic_load_n(&t->joining, __ATOMIC_SEQ_CST);
+
+	if (j && _unjoin(t, j)) {
+		_spin_lock(&j->lock);
+		if (RUN_DONE != __atomic_load_n(&j->run, __ATOMIC_RELAXED)) {
+			// _finish takes them all at once
+			TAILQ_REMOVE(&j->waiters, t, threads);
+		}
+		_spin_unlock(&j->lock);
+		_wake(t);
+	}
+}
+
+
+// Wake a cancelled thread up if it is blocked in thread_group_wait. It takes
+// itself out of the group.
+static void _cancel_group(struct thread *t)
+{
+	thread_group_t *g = __atomic_load_n(&t->waitgroup, __ATOMIC_SEQ_CST);
+
+	if (g && _ungroup(t, g)) {
+		_wake(t);
+	}
+}
+
+
+// Free a thread that is done and switched out.
+static void _thread_drop(struct thread *t)
+{
+	if (t == _mainth) {
+		// special case for the main thread (see __destroy)
+		_thread_free(t);
+		_mainth = NULL;
+	} else if (CLAIM_CANCEL == __atomic_load_n(&t->claimed, __ATOMIC_RELAXED)
+			|| CLAIM_SWITCH == __atomic_load_n(&t->claimed, __ATOMIC_RELAXED)) {
+		// its queue entry may still be around
+		_thread_unref(t);
+	} else {
+		_thread_reclaim(t);
+	}
+}
+
+
+/******************************************/
+/*       CONSTRUCTOR & DESTRUCTOR         */
+/******************************************/
+__attribute__((constructor(101)))
+static void __init()
+{
+	int n, i;
+
+	for (i = 0; i < PRIO_LEVELS; i++) {
+		TAILQ_INIT(&ready[i]);
+	}
+
+	// remember which thread started everything
+	maintid = GETTID;
+
+	pagesize = sysconf(_SC_PAGESIZE);
+	if (getenv("THREAD_STACK_SIZE")
+			&& thread_setstacksize(strtoul(getenv("THREAD_STACK_SIZE"), NULL, 10),
+				NULL)) {
+		fprintf(stderr, "THREAD_STACK_SIZE too small, ignored\n");
+	}
+
+	if (getenv("THREAD_IDLE_SPIN")) {
+		idlespin = strtoul(getenv("THREAD_IDLE_SPIN"), NULL, 10);
+	}
+
+	if (getenv("THREAD_SPAWN_BACKLOG")) {
+		spawnbacklog = strtoul(getenv("THREAD_SPAWN_BACKLOG"), NULL, 10);
+	}
+
+	// preemption, the timers are armed only if a timeslice is set
+	if (getenv("THREAD_TIMESLICE")) {
+		timeslice = strtoul(getenv("THREAD_TIMESLICE"), NULL, 10);
+	}
+
+	struct sigaction sa;
+	memset(&sa, 0, sizeof sa);
+	sa.sa_sigaction = _preempt_handler;
+	sa.sa_flags = SA_SIGINFO | SA_RESTART | SA_NODEFER;
+	sigemptyset(&sa.sa_mask);
+	if (sigaction(PREEMPT_SIGNAL, &sa, NULL)) {
+		perror("sigaction");
+	}
+
+	// per-thread data, before anything looks it up: the main thread is
+	// allocated outside of the kthreads, from malloc
+	pthread_key_create(&key_self, NULL);
+	pthread_key_create(&key_kthread, NULL);
+	pthread_setspecific(key_kthread, NULL);
+
+	// add this thread to the list
+	if (NULL == (_mainth = _thread_new())) {
+		exit(EXIT_FAILURE);
+	}
+
+	_mainth->uc_prev = &_mainth->uc;
+	_mainth->bound = 1;
+	_mainth->inlib = 0;
+	_mainth->claimed = CLAIM_KTHREAD;
+
+	// no stack: nothing is run inline on the process stack, where a thread
+	// would not hit the guard page of the stack it asked for
+	_mainth->userstack = 1;
+
+	// init fallback for the main thread. It runs the posted tasks as the
+	// other kthreads do on their pthread stack: give it as much room, behind
+	// a guard page, only the pages it touches are allocated
+	mainfallback_stack = _stack_map(FALLBACK_STACK_SIZE);
+	if (!mainfallback_stack) {
+		exit(EXIT_FAILURE);
+	}
+
+	VALGRIND_STACK_REGISTER(
+		mainfallback_stack,
+		mainfallback_stack + FALLBACK_STACK_SIZE
+	);
+
+	pthread_setspecific(key_self, _mainth); // 'self' is now _mainth
+
+	// CPU pinning
+	if (getenv("THREAD_CPUS")) {
+		nbpincpus = _parse_cpus(getenv("THREAD_CPUS"), pincpus, MAX_KTHREADS);
+	} else if (getenv("THREAD_PIN") && atoi(getenv("THREAD_PIN"))) {
+		nbpincpus = _affinity_cpus(pincpus, MAX_KTHREADS);
+	}
+
+	// pool size
+	if (getenv("THREAD_KTHREADS")) {
+		n = atoi(getenv("THREAD_KTHREADS"));
+	} else {
+		n = _affinity_cpus(NULL, 0);
+	}
+
+	// kthreads[0] is the main thread
+	if (_kthreads_grow(n < 1 ? 1 : n)) {
+		exit(EXIT_FAILURE);
+	}
+}
+
+
+__attribute__((destructor))
+static void __destroy()
+{
+	// mainfallback_stack is left to the kernel: a posted task calling exit
+	// runs on it
+
+	// special case for the main thread that may not be joined or may not call
+	// thread_exit()
+	if (_mainth) {
+		_thread_free(_mainth);
+	}
+}
+
+
+/******************************************/
+/*       IMPLEMENTATION FUNCTIONS         */
+/******************************************/
+thread_t thread_self(void)
+{
+	return pthread_getspecific(key_self);
+}
+
+
+int thread_attr_init(thread_attr_t *attr)
+{
+	attr->stacksize = 0;
+	attr->stackaddr = NULL;
+	attr->prio = -1;
+	attr->kthread = -1;
+	attr->detachstate = THREAD_CREATE_JOINABLE;
+	attr->spawnmode = THREAD_SPAWN_HELP_FIRST;
+
+	return 0;
+}
+
+
+int thread_attr_setstacksize(thread_attr_t *attr, size_t size)
+{
+	if (size < STACK_MIN_SIZE) {
+		return -1;
+	}
+
+	attr->stacksize = (size + pagesize - 1) & ~(pagesize - 1);
+	attr->stackaddr = NULL;
+
+	return 0;
+}
+
+
+int thread_attr_setstack(thread_attr_t *attr, void *addr, size_t size)
+{
+	if (NULL == addr || size < STACK_MIN_SIZE) {
+		return -1;
+	}
+
+	attr->stackaddr = addr;
+	attr->stacksize = size;
+
+	return 0;
+}
+
+
+int thread_attr_setpriority(thread_attr_t *attr, int prio)
+{
+	if (prio < THREAD_PRIO_MIN || prio > THREAD_PRIO_MAX) {
+		return -1;
+	}
+
+	attr->prio = prio;
+
+	return 0;
+}
+
+
+int thread_attr_setkthread(thread_attr_t *attr, int kthread)
+{
+	if (kthread < -1 || kthread >= MAX_KTHREADS) {
+		return -1;
+	}
+
+	attr->kthread = kthread;
+
+	return 0;
+}
+
+
+int thread_attr_setdetachstate(thread_attr_t *attr, int state)
+{
+	if (THREAD_CREATE_JOINABLE != state && THREAD_CREATE_DETACHED != state) {
+		return -1;
+	}
+
+	attr->detachstate = state;
+
+	return 0;
+}
+
+
+int thread_attr_setspawnmode(thread_attr_t *attr, int mode)
+{
+	if (THREAD_SPAWN_HELP_FIRST != mode && THREAD_SPAWN_WORK_FIRST != mode) {
+		return -1;
+	}
+
+	attr->spawnmode = mode;
+
+	return 0;
+}
+
+
+// If argsize is not 0, funcarg points to an argument of that size to be
+// copied: in the descriptor if it is small, at the top of the stack otherwise,
+// which then has to be bound right away. If group is not NULL, the thread is
+// counted in it before it may run.
+static int _thread_create(thread_t *newthread, const thread_attr_t *attr,
+		void *(*func)(void *), void *funcarg, size_t argsize,
+		thread_group_t *group)
+{
+	size_t size;
+	struct thread *t;
+	struct kthread *target = NULL;
+
+	if (attr && attr->kthread >= 0) {
+		if (attr->kthread >= atomic_load(&nbkthreads)) {
+			return -1;
+		}
+		target = kthreads[attr->kthread];
+	}
+
+	if (attr && attr->stacksize) {
+		size = attr->stacksize;
+	} else {
+		size = __atomic_load_n(&stacksize, __ATOMIC_RELAXED);
+	}
+
+	_lib_enter();
+
+	if (NULL == (t = _thread_new())){
+		_lib_leave();
+		return -1;
+	}
+
+	// the stack is bound when the thread first runs (see _thread_bind)
+	if (attr && attr->stackaddr) {
+		t->stack = attr->stackaddr;
+		t->userstack = 1;
+	}
+
+	t->stacksize = size;
+	t->func = func;
+	t->funcarg = funcarg;
+
+	if (attr) {
+		if (attr->prio >= 0) {
+			t->prio = attr->prio;
+		}
+		t->detached = (THREAD_CREATE_DETACHED == attr->detachstate);
+	}
+
+	if (argsize > ARG_INLINE_SIZE) {
+		t->argtop = (argsize + 15) & ~(size_t) 15;
+		if (_thread_bind(t)) {
+			_thread_free(t);
+			_lib_leave();
+			return -1;
+		}
+		t->funcarg = memcpy(t->stack + t->stacksize - t->argtop, funcarg,
+				argsize);
+	} else if (argsize) {
+		t->funcarg = memcpy(t->argbuf, funcarg, argsize);
+	}
+
+	if (group) {
+		t->group = group;
+		_spin_lock(&group->lock);
+		t->groupnext = group->first;
+		if (t->groupnext) {
+			t->groupnext->groupprev = &t->groupnext;
+		}
+		t->groupprev = &group->first;
+		group->first = t;
+		group->count++;
+		_spin_unlock(&group->lock);
+	}
+
+	_count_created();
+
+	// a detached thread may be gone as soon as it is queued
+	if (newthread) {
+		*newthread = t;
+	}
+
+	if (_spawn_lazy(t, target) && (_spawn_inline(thread_self(), t)
+				|| _spawn_switch(thread_self(), t))) {
+		// it ran before we go on
+	} else if (attr && THREAD_SPAWN_WORK_FIRST == attr->spawnmode
+			&& _spawn_first(t, target)
+			&& (t->bound || 0 == _thread_bind(t))) {
+		// queued as usual below if its stack can not be allocated
+		t->claimed = CLAIM_KTHREAD;
+		// we are queued when the child starts, see _run
+		_magicswap(thread_self(), t);
+	} else if (target && target != _kthread_self()) {
+		_post_job(target, t);
+	} else {
+		_add_job(t);
+	}
+
+	_lib_leave();
+	return 0;
+}
+
+
+int thread_create_attr(thread_t *newthread, const thread_attr_t *attr,
+		void *(*func)(void *), void *funcarg)
+{
+	return _thread_create(newthread, attr, func, funcarg, 0, NULL);
+}
+
+
+int thread_create(thread_t *newthread, void *(*func)(void *), void *funcarg)
+{
+	return _thread_create(newthread, NULL, func, funcarg, 0, NULL);
+}
+
+
+int thread_create_copy(thread_t *newthread, void *(*func)(void *),
+		const void *arg, size_t size)
+{
+	if (size > THREAD_COPY_MAX
+			|| size > __atomic_load_n(&stacksize, __ATOMIC_RELAXED) / 4) {
+		return -1;
+	}
+
+	return _thread_create(newthread, NULL, func, (void *) arg, size, NULL);
+}
+
+
+int thread_post(void (*func)(void *), void *arg, unsigned long *counter)
+{
+	struct kthread *kt;
+	struct task task = { func, arg, counter };
+
+	if (counter) {
+		__atomic_add_fetch(counter, 1, __ATOMIC_RELAXED);
+	}
+
+	// no preemption, we must not move to another kthread while pushing
+	_lib_enter();
+	kt = _kthread_self();
+	if (!kt || _taskq_push(&kt->tq, &task)) {
+		// not a kthread of ours, or a full queue: run it right away
+		_task_run(&task);
+	} else {
+		_wake_idle();
+	}
+	_lib_leave();
+
+	return 0;
+}
+
+
+int thread_post_wait(unsigned long *counter)
+{
+	int ran;
+	struct thread *self = thread_self();
+
+	if (NULL == _kthread_self()) {
+		// not a kthread of ours: no task queue to help with and no thread
+		// to yield, leave the CPU to the kthreads running the tasks
+		while (__atomic_load_n(counter, __ATOMIC_ACQUIRE)) {
+			sched_yield();
+		}
+		return 0;
+	}
+
+	while (1) {
+		// a cancellation point even if it never has to yield
+		if (self) {
+			_testcancel(self);
+		}
+		if (0 == __atomic_load_n(counter, __ATOMIC_ACQUIRE)) {
+			break;
+		}
+
+		// help with the tasks instead of waiting for them
+		_lib_enter();
+		ran = _run_one_task(_kthread_self());
+		_lib_leave();
+
+		if (!ran) {
+			thread_yield();
+		}
+	}
+
+	return 0;
+}
+
+
+static void _yield(struct thread *self)
+{
+	struct thread *next;
+
+	_lib_enter();
+
+	if (!_taskq_empty(&_kthread_self()->tq)) {
+		// let the kthread loop run the posted tasks, it queues us again
+		_switch_out(self);
+	} else if (NULL != (next = _get_job(1, self->prio))) {
+		// only threads of the same priority or higher, and the aged ones
+		_magicswap(self, next);
+	} else {
+#ifdef SWAPINFO
 		fprintf(stderr, "* yield: no other thread ready\n");
 #endif
 	}
 
+	_lib_leave();
+}
+
+
+int thread_yield(void)
+{
+	thread_t self = thread_self();
+	assert(self != NULL);
+
+	// on the way out as well: it may have been cancelled while queued
+	_testcancel(self);
+	_yield(self);
+	_testcancel(self);
+
+	return 0;
+}
+
+int thread_yield_to(thread_t target)
+{
+	int prio;
+	unsigned int levels;
+	struct thread *t = NULL;
+	struct kthread *kt;
+
+	thread_t self = thread_self();
+	assert(self != NULL);
+
+	if (target == self) {
+		return 0;
+	}
+
+	_testcancel(self);
+
+	_lib_enter();
+	kt = _kthread_self();
+
+	// A thread that switched to us on this kthread was put at the bottom of
+	// our deque by _release: that is where a ping-pong partner is found. The
+	// other entries can not be taken out of their queue.
+	prio = __atomic_load_n(&target->prio, __ATOMIC_RELAXED);
+	levels = atomic_load_explicit(&kt->levels, memory_order_relaxed);
+	if (_taskq_empty(&kt->tq) && (levels & (1u << prio))
+			&& NULL != (t = _deque_pop(&kt->rq[prio])) && t != target) {
+		// not the last one queued: put it back where it was
+		_deque_push(&kt->rq[prio], t);
+		t = NULL;
+	}
+
+	if (t && _claim(t)) {
+		if (0 == _take_job(t)) {
+			_magicswap(self, t);
+			_lib_leave();
+			_testcancel(self);
+			return 0;
+		}
+		_requeue(t);
+	}
+
+	_lib_leave();
+	return thread_yield();
+}
+
+
+int thread_setconcurrency(int n)
+{
+	int rv;
+
+	if (n < atomic_load(&nbkthreads)) {
+		// the pool can not shrink
+		return -1;
+	}
+
+	_lib_enter();
+	rv = _kthreads_grow(n);
+	_lib_leave();
+
+	return rv;
+}
+
+
+int thread_getconcurrency(void)
+{
+	return atomic_load(&nbkthreads);
+}
+
+
+int thread_setaffinity(const int *cpus, int nbcpus)
+{
+	int i, n;
+
+	if (nbcpus < 0 || nbcpus > MAX_KTHREADS || (nbcpus > 0 && NULL == cpus)) {
+		return -1;
+	}
+
+	_lib_enter();
+	pthread_mutex_lock(&kthreadsmtx);
+	if (cpus) {
+		memcpy(pincpus, cpus, nbcpus * sizeof *cpus);
+		nbpincpus = nbcpus;
+	} else {
+		nbpincpus = _affinity_cpus(pincpus, MAX_KTHREADS);
+	}
+
+	n = atomic_load(&nbkthreads);
+	for (i = 0; i < n; i++) {
+		_kthread_pin(kthreads[i]);
+	}
+	pthread_mutex_unlock(&kthreadsmtx);
+	_lib_leave();
+
+	return 0;
+}
+
+
+int thread_setidlespin(unsigned int spins, unsigned int *oldspins)
+{
+	unsigned int old = atomic_exchange(&idlespin, spins);
+
+	if (oldspins) {
+		*oldspins = old;
+	}
+
+	return 0;
+}
+
+
+int thread_setstacksize(size_t size, size_t *oldsize)
+{
+	size_t old;
+
+	if (size < STACK_MIN_SIZE) {
+		return -1;
+	}
+
+	size = (size + pagesize - 1) & ~(pagesize - 1);
+	old = __atomic_exchange_n(&stacksize, size, __ATOMIC_RELAXED);
+
+	if (oldsize) {
+		*oldsize = old;
+	}
+
+	return 0;
+}
+
+
+int thread_setspawnbacklog(unsigned int backlog, unsigned int *oldbacklog)
+{
+	unsigned int old = atomic_exchange(&spawnbacklog, backlog);
+
+	if (oldbacklog) {
+		*oldbacklog = old;
+	}
+
+	return 0;
+}
+
+
+int thread_settimeslice(unsigned int usec, unsigned int *oldusec)
+{
+	int i, n;
+	unsigned int old = atomic_exchange(&timeslice, usec);
+
+	if (oldusec) {
+		*oldusec = old;
+	}
+
+	n = atomic_load(&nbkthreads);
+	for (i = 0; i < n; i++) {
+		if (atomic_load(&kthreads[i]->hastimer)) {
+			_kthread_timer_arm(kthreads[i], usec);
+		}
+	}
+
+	return 0;
+}
+
+
+void thread_preempt_disable(void)
+{
+	struct thread *self = thread_self();
+
+	if (self) {
+		self->nopreempt++;
+		atomic_signal_fence(memory_order_seq_cst);
+	}
+}
+
+
+void thread_preempt_enable(void)
+{
+	struct thread *self = thread_self();
+
+	if (NULL == self) {
+		return;
+	}
+
+	atomic_signal_fence(memory_order_seq_cst);
+	if (0 == --self->nopreempt && self->preemptpending) {
+		self->preemptpending = 0;
+		_yield(self);
+	}
+}
+
+
+int thread_detach(thread_t thread)
+{
+	if (thread == _mainth || thread->detached) {
+		return -1;
+	}
+
+	_lib_enter();
+
+	_spin_lock(&thread->lock);
+	if (RUN_DONE != __atomic_load_n(&thread->run, __ATOMIC_RELAXED)) {
+		// _release will reclaim it
+		thread->detached = 1;
+		_spin_unlock(&thread->lock);
+		_lib_leave();
+		return 0;
+	}
+	_spin_unlock(&thread->lock);
+
+	// done and switched out
+	_thread_drop(thread);
+
+	_lib_leave();
+	return 0;
+}
+
+
+int thread_setpriority(thread_t thread, int prio)
+{
+	if (prio < THREAD_PRIO_MIN || prio > THREAD_PRIO_MAX) {
+		return -1;
+	}
+
+	// a queued thread keeps its level until it is queued again
+	__atomic_store_n(&thread->prio, prio, __ATOMIC_RELAXED);
+
+	return 0;
+}
+
+
+int thread_getpriority(thread_t thread)
+{
+	return __atomic_load_n(&thread->prio, __ATOMIC_RELAXED);
+}
+
+
+int thread_setcancelstate(int state, int *oldstate)
+{
+	struct thread *self = thread_self();
+	
+	assert(self != NULL);
+
+	if (oldstate) {
+		*oldstate = self->state;
+	}
+	
+	self->state = state;
+	
+	return 0;
+}
+
+static void _cancel_cond(struct thread *t);
+
+int thread_cancel(thread_t thread)
+{
+	assert(thread != NULL);
+
+	_lib_enter();
+
+	// seen by the thread at its next cancellation point. Pairs with the
+	// stores to 'joining', 'waitgroup' and 'waitcond' in the waits.
+	__atomic_store_n(&thread->canceled, 1, __ATOMIC_SEQ_CST);
+
+	if (THREAD_CANCEL_ENABLE == __atomic_load_n(&thread->state, __ATOMIC_RELAXED)) {
+		if (_cancel_claim(thread)) {
+			_cancel_finish(thread);
+		} else {
+			_cancel_join(thread);
+			_cancel_group(thread);
+			_cancel_cond(thread);
+		}
+	}
+
+	_lib_leave();
+	return 0;
+}
+
+
+void thread_testcancel(void)
+{
+	struct thread *self = thread_self();
+
+	if (self) {
+		_testcancel(self);
+	}
+}
+
+
+void _thread_cleanup_push(struct thread_cleanup *cleanup)
+{
+	struct thread *self = thread_self();
+
+	assert(self != NULL);
+
+	cleanup->prev = self->cleanup;
+	self->cleanup = cleanup;
+}
+
+
+void _thread_cleanup_pop(struct thread_cleanup *cleanup, int execute)
+{
+	struct thread *self = thread_self();
+
+	assert(self != NULL && self->cleanup == cleanup);
+
+	self->cleanup = cleanup->prev;
+	if (execute) {
+		cleanup->routine(cleanup->arg);
+	}
+}
+
+
+int thread_join(thread_t thread, void **retval)
+{
+	int rv = 0;
+	struct thread *self = thread_self();
+
+	assert(self != NULL);
+
+	if (thread->detached) {
+		return -1;
+	}
+
+	_testcancel(self);
+
+	_lib_enter();
+
+	if (_join_inline(self, thread)) {
+		if (retval) {
+			*retval = thread->retval;
+		}
+		_thread_unref(thread);
+		_lib_leave();
+		return 0;
+	}
+
+	_spin_lock(&thread->lock);
+	if (RUN_DONE != __atomic_load_n(&thread->run, __ATOMIC_RELAXED)) {
+		// park until _release puts us back in the ready queue, once the
+		// thread is done and off its stack, or until thread_cancel does
+		self->isblocked = 1;
+		TAILQ_INSERT_TAIL(&thread->waiters, self, threads);
+		__atomic_store_n(&self->joining, thread, __ATOMIC_SEQ_CST);
+
+		if (_cancelpending(self) && _unjoin(self, thread)) {
+			// thread_cancel came first and found nobody to wake up
+			TAILQ_REMOVE(&thread->waiters, self, threads);
+			self->isblocked = 0;
+			_spin_unlock(&thread->lock);
+		} else {
+			_spin_unlock(&thread->lock);
+			if (!_join_switch(self, thread)) {
+				_switch_out(self);
+			}
+		}
+	} else {
+		_spin_unlock(&thread->lock);
+	}
+
+	if (RUN_DONE != __atomic_load_n(&thread->run, __ATOMIC_ACQUIRE)) {
+		// cancelled, the thread stays joinable
+		_lib_leave();
+		thread_exit(THREAD_CANCELED);
+	}
+
+	if (retval) {
+		*retval = thread->retval;
+	}
+
+	// libérer ressource
+	_thread_drop(thread);
+	
+	_lib_leave();
+	return rv;
+}
+
+
+// A thread started by the thread that waits for it (_join_switch,
+// _spawn_switch) switches back to it when done, instead of going through the
+// scheduler. Returns the waiter, taken from the waiters, or NULL if it is
+// not switched out yet or thread_cancel woke it up already.
+static struct thread *_exit_waiter(struct thread *self)
+{
+	int s = RUN_BLOCKED;
+	struct thread *w;
+
+	if (CLAIM_SWITCH != __atomic_load_n(&self->claimed, __ATOMIC_RELAXED)) {
+		return NULL;
+	}
+
+	_spin_lock(&self->lock);
+	w = TAILQ_FIRST(&self->waiters);
+	if (w && _unjoin(w, self)) {
+		// nobody else wakes it up now
+		TAILQ_REMOVE(&self->waiters, w, threads);
+	} else {
+		w = NULL;
+	}
+	_spin_unlock(&self->lock);
+
+	if (w && !__atomic_compare_exchange_n(&w->run, &s, RUN_RUNNING, 0,
+				__ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+		// still switching out
+		_wake(w);
+		w = NULL;
+	} else if (w) {
+		w->isblocked = 0;
+	}
+
+	return w;
+}
+
+
+void thread_exit(void *retval)
+{
+	struct thread_cleanup *c;
+	struct thread *w;
+	thread_t self = thread_self();
+	assert(self != NULL);
+	// called from user code: every _lib_enter was matched
+	assert(0 == self->inlib);
+
+	// the handlers are user code, they run outside of the library and may
+	// not be cancelled
+	self->state = THREAD_CANCEL_DISABLE;
+	while (NULL != (c = self->cleanup)) {
+		self->cleanup = c->prev;
+		c->routine(c->arg);
+	}
+
+	// never left
+	_lib_enter();
+
+	if (self->inlinejmp) {
+		// run by its joiner, which finishes the job
+		self->retval = retval;
+		_longjmp(*self->inlinejmp, 1);
+	}
+
+	_spin_lock(&self->lock);
+	self->isdone = 1;
+	self->retval = retval;
+	_spin_unlock(&self->lock);
+
+	_count_exited();
+
+	if (_last_exited() && !atomic_exchange(&terminating, 1)) {
+		// last thread just died, clean up
+		if (self != _mainth) {
+			VALGRIND_STACK_DEREGISTER(self->valgrind_stackid);
+			//free(self->stack);
+			_thread_free(self);
+		} else {
+			// special case for _mainth
+			_thread_free(self);
+			_mainth = NULL;
+		}
+
+		exit(EXIT_SUCCESS);
+	}
+
+	// this wasn't the last thread, either swap to another thread if
+	// possible or fallback to the _clone_func to wait for new jobs. The
+	// joiners are woken up by _release, once we are off our stack.
+	if (NULL != (w = _exit_waiter(self))) {
+		_magicswap(self, w);
+	} else {
+		_switch_out(self);
+	}
+
+	// we should never reach this point
+	assert(0);
+	abort();
+}
+
+
+/******************************************/
+/*       THREAD GROUPS                    */
+/******************************************/
+// The members of a group are detached threads, linked in the group until
+// _finish. The group lock nests outside the thread locks (thread_group_cancel
+// wakes joiners up under it), _finish takes it before the thread lock.
+
+int thread_group_init(thread_group_t *group)
+{
+	thread_group_t init = THREAD_GROUP_INITIALIZER;
+
+	*group = init;
 	return 0;
 }
 
-int thread_setcancelstate(int state, int *oldstate)
+
+int thread_group_destroy(thread_group_t *group)
+{
+	return (0 == __atomic_load_n(&group->count, __ATOMIC_RELAXED)) ? 0 : -1;
+}
+
+
+int thread_group_create(thread_group_t *group, const thread_attr_t *attr,
+		void *(*func)(void *), void *funcarg)
+{
+	thread_attr_t a;
+
+	if (attr) {
+		a = *attr;
+	} else {
+		thread_attr_init(&a);
+	}
+	a.detachstate = THREAD_CREATE_DETACHED;
+
+	return _thread_create(NULL, &a, func, funcarg, 0, group);
+}
+
+
+int thread_group_wait(thread_group_t *group)
 {
 	struct thread *self = thread_self();
-	
+
 	assert(self != NULL);
+	assert(self->group != group);
 
-	if (oldstate) {
-		*oldstate = self->state;
+	_testcancel(self);
+
+	_lib_enter();
+
+	_spin_lock(&group->lock);
+	if (group->waiter) {
+		_spin_unlock(&group->lock);
+		_lib_leave();
+		return -1;
 	}
-	
-	self->state = state;
-	
+	if (0 == group->count) {
+		_spin_unlock(&group->lock);
+		_lib_leave();
+		return 0;
+	}
+
+	// park until the last member is done
+	self->isblocked = 1;
+	group->waiter = self;
+	// pairs with the store to 'canceled' in thread_cancel
+	__atomic_store_n(&self->waitgroup, group, __ATOMIC_SEQ_CST);
+	_spin_unlock(&group->lock);
+
+	if (_cancelpending(self) && _ungroup(self, group)) {
+		// thread_cancel may have missed us
+		self->isblocked = 0;
+	} else {
+		_switch_out(self);
+	}
+
+	// if thread_cancel woke us up, 'waiter' is still set
+	_spin_lock(&group->lock);
+	if (self == group->waiter) {
+		group->waiter = NULL;
+	}
+	_spin_unlock(&group->lock);
+
+	_lib_leave();
+
+	_testcancel(self);
 	return 0;
 }
 
-int thread_cancel(thread_t thread)
+
+int thread_group_cancel(thread_group_t *group)
 {
-	assert(thread != NULL);
-	
-	if (thread_self() == thread) {
-		thread->canceled = 1;	
-	} else {
-		pthread_mutex_lock(&thread->mtx);
-		thread->canceled = 1;
-		pthread_mutex_unlock(&thread->mtx);
+	struct thread *t, *next, *claimed = NULL;
+
+	_lib_enter();
+
+	_spin_lock(&group->lock);
+	for (t = group->first; t; t = next) {
+		next = t->groupnext;
+
+		// as thread_cancel
+		__atomic_store_n(&t->canceled, 1, __ATOMIC_SEQ_CST);
+		if (THREAD_CANCEL_ENABLE != __atomic_load_n(&t->state, __ATOMIC_RELAXED)) {
+			continue;
+		}
+
+		if (_cancel_claim(t)) {
+			// finished once the lock is released, _finish takes it
+			_group_unlink(t);
+			t->groupnext = claimed;
+			claimed = t;
+		} else {
+			_cancel_join(t);
+			_cancel_group(t);
+			_cancel_cond(t);
+		}
+	}
+	_spin_unlock(&group->lock);
+
+	// the group may be gone once the last one is finished
+	while (NULL != (t = claimed)) {
+		claimed = t->groupnext;
+		_cancel_finish(t);
 	}
-		
+
+	_lib_leave();
 	return 0;
 }
 
 
-int thread_join(thread_t thread, void **retval)
+/******************************************/
+/*   MUTEXES AND CONDITION VARIABLES      */
+/******************************************/
+// mutex state: 0 = free, 1 = locked, 2 = locked and there may be waiters.
+// The fields of the public structures are accessed with the __atomic
+// builtins since thread.h has to stay usable without <stdatomic.h>.
+//
+// Unlocking a contended mutex hands it over directly to the first waiter: a
+// thread that wakes up from thread_mutex_lock or thread_cond_wait already owns
+// the mutex.
+
+static void _waitq_push(struct thread **first, struct thread **last,
+		struct thread *t)
 {
-	int rv = 0;
+	t->nextwait = NULL;
+	if (*last) {
+		(*last)->nextwait = t;
+	} else {
+		*first = t;
+	}
+	*last = t;
+}
+
+
+static struct thread *_waitq_pop(struct thread **first, struct thread **last)
+{
+	struct thread *t = *first;
 
-	pthread_mutex_lock(&thread->mtx);
-	while (!thread->isdone) {
-		pthread_mutex_unlock(&thread->mtx);
-		thread_yield();
-		pthread_mutex_lock(&thread->mtx);
+	if (t) {
+		*first = t->nextwait;
+		if (NULL == *first) {
+			*last = NULL;
+		}
+	}
+
+	return t;
+}
+
+
+// t must be in the queue
+static void _waitq_remove(struct thread **first, struct thread **last,
+		struct thread *t)
+{
+	struct thread *prev = NULL, **link = first;
+
+	while (*link != t) {
+		prev = *link;
+		link = &prev->nextwait;
+	}
+	*link = t->nextwait;
+	if (*last == t) {
+		*last = prev;
 	}
+}
+
 
-	*retval = thread->retval;
+// Acquire m on behalf of t, or queue t on m if it is taken. t must be blocked.
+// Returns 1 if t now owns the mutex and must be woken up.
+static int _mutex_acquire_or_queue(thread_mutex_t *m, struct thread *t)
+{
+	int acquired;
 
-	if (thread != _mainth) {
-		// libérer ressource
-		VALGRIND_STACK_DEREGISTER(thread->valgrind_stackid);
-		free(thread->uc.uc_stack.ss_sp);
-		pthread_mutex_unlock(&thread->mtx);
-		free(thread);
+	_spin_lock(&m->lock);
+	acquired = (0 == __atomic_exchange_n(&m->state, 2, __ATOMIC_ACQUIRE));
+	if (acquired) {
+		__atomic_store_n(&m->owner, t, __ATOMIC_RELAXED);
 	} else {
-		// special case for the main thread (see __destroy)
-		pthread_mutex_unlock(&thread->mtx);
-		free(thread);
-		_mainth = NULL;
+		_waitq_push(&m->waitfirst, &m->waitlast, t);
 	}
-	
-	return rv;
+	_spin_unlock(&m->lock);
+
+	return acquired;
 }
 
 
-void thread_exit(void *retval)
+int thread_mutex_init(thread_mutex_t *mutex)
 {
-	int cond;
-	struct thread *next;
+	thread_mutex_t init = THREAD_MUTEX_INITIALIZER;
 
-	thread_t self = thread_self();
-	assert(self != NULL);
+	*mutex = init;
+	return 0;
+}
 
-	self->isdone = 1;
-	self->retval = retval;
 
-	pthread_mutex_lock(&thcountmtx);
-	thcount--;
-	cond = (thcount == 0);
-	pthread_mutex_unlock(&thcountmtx);
+int thread_mutex_destroy(thread_mutex_t *mutex)
+{
+	return (0 == __atomic_load_n(&mutex->state, __ATOMIC_RELAXED)) ? 0 : -1;
+}
 
-	if (cond) {
-		// last thread just died, clean up
-		pthread_mutex_unlock(&self->mtx);
 
-		if (self != _mainth) {
-			VALGRIND_STACK_DEREGISTER(self->valgrind_stackid);
-			//free(self->uc.uc_stack.ss_sp);
-			free(self);
-		} else {
-			// special case for _mainth
-			free(self);
-			_mainth = NULL;
-		}
+int thread_mutex_trylock(thread_mutex_t *mutex)
+{
+	int expected = 0;
 
-		exit(EXIT_SUCCESS);
+	if (__atomic_compare_exchange_n(&mutex->state, &expected, 1, 0,
+				__ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+		__atomic_store_n(&mutex->owner, thread_self(), __ATOMIC_RELAXED);
+		return 0;
+	}
+
+	return -1;
+}
+
+
+int thread_mutex_lock(thread_mutex_t *mutex)
+{
+	int i;
+	struct thread *owner, *self = thread_self();
+
+	assert(self != NULL);
+
+	if (0 == thread_mutex_trylock(mutex)) {
+		return 0;
 	}
 
-	else {
-		// this wasn't the last thread, either swap to another thread if
-		// possible or fallback to the _clone_func to wait for new jobs.
-		if (!sem_trywait(&nbready)) {
-			next = _get_job();
-			assert(next != NULL);
-			_magicswap(self, next);
+	_lib_enter();
+
+	// the owner is running on another kthread, it will probably release the
+	// mutex soon: spin a little before parking
+	for (i = 0; i < MUTEX_SPIN; i++) {
+		owner = __atomic_load_n(&mutex->owner, __ATOMIC_RELAXED);
+		if (NULL == owner
+				|| RUN_RUNNING != __atomic_load_n(&owner->run, __ATOMIC_RELAXED)) {
+			break;
 		}
-		
-		else {
-			if (GETTID == maintid) {
-#ifdef SWAPINFO
-				fprintf(stderr, "MAIN fall back to the infinite loop\n");
-#endif
-				swapcontext(&self->uc, &mainfallback);
-			} else {
-#ifdef SWAPINFO
-				fprintf(stderr, "CLONE fall back to the infinite loop\n");
-#endif
-				swapcontext(&self->uc, self->uc_prev);
-			}
+		CPU_RELAX();
+		if (0 == __atomic_load_n(&mutex->state, __ATOMIC_RELAXED)
+				&& 0 == thread_mutex_trylock(mutex)) {
+			_lib_leave();
+			return 0;
 		}
 	}
 
-	// we should never reach this point
-	assert(0);
+	self->isblocked = 1;
+	if (_mutex_acquire_or_queue(mutex, self)) {
+		self->isblocked = 0;
+		_lib_leave();
+		return 0;
+	}
+
+	// thread_mutex_unlock hands us the mutex
+	_switch_out(self);
+	assert(mutex->owner == self);
+
+	_lib_leave();
+	return 0;
+}
+
+
+int thread_mutex_unlock(thread_mutex_t *mutex)
+{
+	int expected = 1;
+	struct thread *next;
+
+	__atomic_store_n(&mutex->owner, NULL, __ATOMIC_RELAXED);
+
+	if (__atomic_compare_exchange_n(&mutex->state, &expected, 0, 0,
+				__ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+		return 0;
+	}
+
+	_lib_enter();
+
+	_spin_lock(&mutex->lock);
+	next = _waitq_pop(&mutex->waitfirst, &mutex->waitlast);
+	if (next) {
+		// hand over, the mutex stays locked
+		__atomic_store_n(&mutex->owner, next, __ATOMIC_RELAXED);
+		if (NULL == mutex->waitfirst) {
+			__atomic_store_n(&mutex->state, 1, __ATOMIC_RELAXED);
+		}
+	} else {
+		__atomic_store_n(&mutex->state, 0, __ATOMIC_RELEASE);
+	}
+	_spin_unlock(&mutex->lock);
+
+	if (next) {
+		_wake(next);
+	}
+
+	_lib_leave();
+	return 0;
+}
+
+
+int thread_cond_init(thread_cond_t *cond)
+{
+	thread_cond_t init = THREAD_COND_INITIALIZER;
+
+	*cond = init;
+	return 0;
+}
+
+
+int thread_cond_destroy(thread_cond_t *cond)
+{
+	return (NULL == cond->waitfirst) ? 0 : -1;
+}
+
+
+// Take t out of the queue of cond, if it is still there. Whoever does it,
+// under the condition lock, owns the waiter: returns 1 then.
+static int _cond_unqueue(thread_cond_t *cond, struct thread *t)
+{
+	int taken = 0;
+
+	_spin_lock(&cond->lock);
+	if (cond == t->waitcond) {
+		_waitq_remove(&cond->waitfirst, &cond->waitlast, t);
+		t->waitcond = NULL;
+		taken = 1;
+	}
+	_spin_unlock(&cond->lock);
+
+	return taken;
+}
+
+
+int thread_cond_wait(thread_cond_t *cond, thread_mutex_t *mutex)
+{
+	struct thread *self = thread_self();
+
+	assert(self != NULL);
+
+	_testcancel(self);
+
+	_lib_enter();
+
+	self->isblocked = 1;
+	self->waitmutex = mutex;
+
+	_spin_lock(&cond->lock);
+	_waitq_push(&cond->waitfirst, &cond->waitlast, self);
+	// pairs with the store to 'canceled' in thread_cancel
+	__atomic_store_n(&self->waitcond, cond, __ATOMIC_SEQ_CST);
+	_spin_unlock(&cond->lock);
+
+	// thread_cancel may have missed us: leave the queue ourselves unless
+	// somebody took us out of it already
+	if (_cancelpending(self) && _cond_unqueue(cond, self)) {
+		self->isblocked = 0;
+		_lib_leave();
+		// does not return, the cleanup handlers get the mutex
+		_testcancel(self);
+	}
+
+	thread_mutex_unlock(mutex);
+
+	// woken up by signal/broadcast/cancel once we own the mutex again
+	_switch_out(self);
+	assert(mutex->owner == self);
+
+	_lib_leave();
+
+	// with the mutex, for the cleanup handlers to release it
+	_testcancel(self);
+	return 0;
+}
+
+
+// Wait morphing: rather than waking the waiter up only for it to block on the
+// mutex, move it to the mutex queue, or give it the mutex if it is free.
+static void _cond_requeue(struct thread *t)
+{
+	if (_mutex_acquire_or_queue(t->waitmutex, t)) {
+		_wake(t);
+	}
+}
+
+
+// Wake a cancelled thread up if it is blocked in thread_cond_wait, as a
+// signal would: it runs its cleanup handlers with the mutex.
+static void _cancel_cond(struct thread *t)
+{
+	thread_cond_t *cond = __atomic_load_n(&t->waitcond, __ATOMIC_SEQ_CST);
+
+	if (cond && _cond_unqueue(cond, t)) {
+		_cond_requeue(t);
+	}
+}
+
+
+int thread_cond_signal(thread_cond_t *cond)
+{
+	struct thread *t;
+
+	_lib_enter();
+
+	_spin_lock(&cond->lock);
+	if (NULL != (t = _waitq_pop(&cond->waitfirst, &cond->waitlast))) {
+		t->waitcond = NULL;
+	}
+	_spin_unlock(&cond->lock);
+
+	if (t) {
+		_cond_requeue(t);
+	}
+
+	_lib_leave();
+	return 0;
 }
 
+
+int thread_cond_broadcast(thread_cond_t *cond)
+{
+	struct thread *t, *first;
+
+	_lib_enter();
+
+	_spin_lock(&cond->lock);
+	first = cond->waitfirst;
+	cond->waitfirst = cond->waitlast = NULL;
+	for (t = first; t; t = t->nextwait) {
+		t->waitcond = NULL;
+	}
+	_spin_unlock(&cond->lock);
+
+	while (NULL != (t = first)) {
+		first = t->nextwait;
+		_cond_requeue(t);
+	}
+
+	_lib_leave();
+	return 0;
+}
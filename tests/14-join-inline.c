@@ -0,0 +1,93 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include "thread.h"
+
+/* test du join d'un thread qui n'a pas encore démarré: il peut être
+ * exécuté directement sur la pile du thread qui le joint, ou sur la sienne
+ * mais sans passer par l'ordonnanceur. Il doit se comporter comme un thread
+ * normal.
+ *
+ * chaque thread crée son fils puis un témoin, mis en file après lui, avant
+ * de joindre le fils. Avec un seul thread noyau, l'ordonnanceur (qui prend
+ * le dernier thread mis en file) exécuterait le témoin d'abord: le fils
+ * vérifie à son démarrage que le témoin n'a pas encore tourné.
+ *
+ * le programme doit retourner correctement.
+ *
+ * support nécessaire:
+ * - thread_create()
+ * - thread_self()
+ * - thread_yield()
+ * - thread_exit()
+ * - thread_join() avec récupération de la valeur de retour
+ * - thread_getconcurrency()
+ */
+
+static thread_t handles[64];
+static volatile int witnessed[64];
+
+static void * witness(void *_depth)
+{
+  witnessed[(long) _depth] = 1;
+  return NULL;
+}
+
+static void spawn(long depth, void *(*func)(void *))
+{
+  thread_t th;
+  void *res;
+  int err;
+
+  witnessed[depth] = 0;
+  err = thread_create(&handles[depth], func, (void *) depth);
+  assert(!err);
+  err = thread_create(&th, witness, (void *) depth);
+  assert(!err);
+
+  err = thread_join(handles[depth], &res);
+  assert(!err);
+  assert(res == (void *) depth);
+  err = thread_join(th, NULL);
+  assert(!err);
+  assert(witnessed[depth]);
+}
+
+static void * thfunc(void *_depth)
+{
+  long depth = (long) _depth;
+  int i;
+
+  /* démarré par le join, avant le témoin */
+  if (1 == thread_getconcurrency())
+    assert(!witnessed[depth]);
+
+  /* chaque thread est lui-même */
+  assert(thread_self() == handles[depth]);
+
+  for (i = 0; i < 3; i++)
+    thread_yield();
+  assert(thread_self() == handles[depth]);
+
+  if (depth + 1 < 64)
+    spawn(depth + 1, thfunc);
+
+  assert(thread_self() == handles[depth]);
+
+  if (depth % 2)
+    thread_exit((void *) depth);
+  return (void *) depth;
+}
+
+int main(int argc, char *argv[])
+{
+  int i, nb;
+
+  nb = argc < 2 ? 100 : atoi(argv[1]);
+
+  for (i = 0; i < nb; i++)
+    spawn(0, thfunc);
+
+  printf("%d arbres de 64 threads joints\n", nb);
+  return 0;
+}
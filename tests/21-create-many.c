@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <assert.h>
 #include <stdlib.h>
+#include <sys/time.h>
 #include "thread.h"
 
 /* test de plein de create-destroy consécutifs.
@@ -25,6 +26,8 @@ int main(int argc, char *argv[])
   thread_t th;
   int err, i, nb;
   void *res;
+  struct timeval tv1, tv2;
+  unsigned long us;
 
   if (argc < 2) {
     printf("argument manquant: nombre de threads\n");
@@ -33,6 +36,8 @@ int main(int argc, char *argv[])
 
   nb = atoi(argv[1]);
 
+  gettimeofday(&tv1, NULL);
+
   for(i=0; i<nb; i++) {
     err = thread_create(&th, thfunc, NULL);
     assert(!err);
@@ -41,6 +46,9 @@ int main(int argc, char *argv[])
     assert(res == NULL);
   }
 
-  printf("%d threads créés et détruits\n", nb);
+  gettimeofday(&tv2, NULL);
+  us = (tv2.tv_sec-tv1.tv_sec)*1000000+(tv2.tv_usec-tv1.tv_usec);
+  printf("%d threads créés et détruits: %ld us (%.0f create+join/s)\n",
+	 nb, us, us ? nb * 1e6 / us : 0.);
   return 0;
 }
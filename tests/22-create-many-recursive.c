@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <assert.h>
 #include <stdlib.h>
+#include <sys/time.h>
 #include "thread.h"
 
 /* test de plein de create-destroy récursif.
@@ -34,6 +35,8 @@ static void * thfunc(void *_nb)
 int main(int argc, char *argv[])
 {
   unsigned long nb;
+  struct timeval tv1, tv2;
+  unsigned long us;
 
   if (argc < 2) {
     printf("argument manquant: nombre de threads\n");
@@ -42,8 +45,13 @@ int main(int argc, char *argv[])
 
   nb = atoi(argv[1]);
 
+  gettimeofday(&tv1, NULL);
+
   thfunc((void*) nb);
 
-  printf("%ld threads créés et détruits récursivement\n", nb);
+  gettimeofday(&tv2, NULL);
+  us = (tv2.tv_sec-tv1.tv_sec)*1000000+(tv2.tv_usec-tv1.tv_usec);
+  printf("%ld threads créés et détruits récursivement: %ld us (%.0f create+join/s)\n",
+	 nb, us, us ? nb * 1e6 / us : 0.);
   return 0;
 }
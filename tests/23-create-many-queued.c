@@ -0,0 +1,70 @@
+#include <stdio.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include "thread.h"
+
+/* test de plein de create sans join intermédiaire: tous les threads sont
+ * créés avant d'être joints.
+ *
+ * un thread qui attend dans la file ne doit coûter que son descripteur, pas
+ * une pile.
+ *
+ * support nécessaire:
+ * - thread_create()
+ * - thread_join() avec récupération de la valeur de retour
+ */
+
+static void * thfunc(void *arg)
+{
+  return arg;
+}
+
+static long maxrss(void)
+{
+  struct rusage ru;
+
+  getrusage(RUSAGE_SELF, &ru);
+  return ru.ru_maxrss;
+}
+
+int main(int argc, char *argv[])
+{
+  thread_t *th;
+  int err, i, nb;
+  void *res;
+  long rss;
+
+  if (argc < 2) {
+    printf("argument manquant: nombre de threads\n");
+    return -1;
+  }
+
+  nb = atoi(argv[1]);
+  th = malloc(nb * sizeof(thread_t));
+  assert(th);
+
+  rss = maxrss();
+
+  for(i=0; i<nb; i++) {
+    err = thread_create(&th[i], thfunc, (void*)(long) i);
+    assert(!err);
+  }
+
+  rss = maxrss() - rss;
+
+  for(i=0; i<nb; i++) {
+    err = thread_join(th[i], &res);
+    assert(!err);
+    assert(res == (void*)(long) i);
+  }
+
+  printf("%d threads en attente: %ld Ko (%.0f octets par thread)\n",
+	 nb, rss, nb ? rss * 1024. / nb : 0.);
+
+  /* bien moins qu'une page de pile par thread */
+  assert(rss * 1024 < (long) nb * 2048);
+
+  free(th);
+  return 0;
+}
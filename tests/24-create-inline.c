@@ -0,0 +1,111 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include "thread.h"
+
+/* test de create quand la file est déjà bien remplie: le thread est alors
+ * exécuté directement par thread_create, sur la pile du créateur si elle a
+ * la place d'accueillir la sienne, sur sa propre pile sinon. Les threads sont
+ * créés par le main, dont les piles par défaut ne tiennent pas sur la pile,
+ * puis par un thread dont la pile de 1 Mo a la place. Ils doivent rester
+ * joignables normalement.
+ *
+ * à lancer avec THREAD_KTHREADS=1 pour vérifier à quel moment les threads
+ * sont exécutés.
+ *
+ * support nécessaire:
+ * - thread_setspawnbacklog()
+ * - thread_create(), thread_create_attr(), thread_attr_setstacksize()
+ * - thread_exit()
+ * - thread_join() avec récupération de la valeur de retour
+ */
+
+#define BACKLOG 8
+#define NB 100
+
+static int ran[NB];
+
+static void * thfunc(void *_i)
+{
+  long i = (long) _i;
+
+  ran[i] = 1;
+
+  if (i % 2)
+    thread_exit(_i);
+  return _i;
+}
+
+static void spawn(void)
+{
+  thread_t th[NB];
+  void *res;
+  int err, i;
+
+  err = thread_setspawnbacklog(BACKLOG, NULL);
+  assert(!err);
+
+  for (i = 0; i < NB; i++) {
+    ran[i] = 0;
+    err = thread_create(&th[i], thfunc, (void *) (long) i);
+    assert(!err);
+    if (1 == thread_getconcurrency())
+      /* les BACKLOG premiers attendent, les suivants sont exécutés */
+      assert(ran[i] == (i >= BACKLOG));
+  }
+
+  for (i = 0; i < NB; i++) {
+    err = thread_join(th[i], &res);
+    assert(!err);
+    assert(res == (void *) (long) i);
+  }
+
+  /* désactivé: rien n'est exécuté avant le join */
+  err = thread_setspawnbacklog(0, NULL);
+  assert(!err);
+
+  for (i = 0; i < NB; i++) {
+    ran[i] = 0;
+    err = thread_create(&th[i], thfunc, (void *) (long) i);
+    assert(!err);
+  }
+  if (1 == thread_getconcurrency())
+    for (i = 0; i < NB; i++)
+      assert(!ran[i]);
+
+  for (i = 0; i < NB; i++) {
+    err = thread_join(th[i], &res);
+    assert(!err);
+    assert(res == (void *) (long) i);
+  }
+}
+
+static void * spawner(void *arg)
+{
+  /* démarré directement par le join du main, son entrée est restée dans la
+   * file: la laisser passer pour ne pas la compter parmi les threads en
+   * attente */
+  thread_yield();
+
+  spawn();
+  return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+  thread_attr_t attr;
+  thread_t th;
+  int err;
+
+  spawn();
+
+  thread_attr_init(&attr);
+  thread_attr_setstacksize(&attr, 1024*1024);
+  err = thread_create_attr(&th, &attr, spawner, NULL);
+  assert(!err);
+  err = thread_join(th, NULL);
+  assert(!err);
+
+  printf("2 x %d threads créés avec une file limitée à %d\n", NB, BACKLOG);
+  return 0;
+}
@@ -11,7 +11,7 @@
  * jusqu'à quelle valeur cela fonctionne-t-il ?
  *
  * support nécessaire:
- * - thread_create()
+ * - thread_create_attr()
  * - thread_join() avec récupération de la valeur de retour
  * - retour sans thread_exit()
  */
@@ -23,6 +23,7 @@
 #define HRANGE 100
 
 TYPE *T;
+static thread_attr_t attr;
 
 static void print(TYPE length) {
   if(length > 100)
@@ -77,9 +78,9 @@ static void * quicksort(void *_value)
   TYPE value1[2] = {first, pivot - 1};
   TYPE value2[2] = {pivot + 1, last};
   
-  err = thread_create(&th, quicksort, (void*)value1);
+  err = thread_create_attr(&th, &attr, quicksort, (void*)value1);
   assert(!err);
-  err = thread_create(&th2, quicksort, (void*)value2);
+  err = thread_create_attr(&th2, &attr, quicksort, (void*)value2);
   assert(!err);
 
   err = thread_join(th, &res);
@@ -98,6 +99,11 @@ int main(int argc, char *argv[])
     printf("argument manquant: entier n donnant la taille du tableau\n");
     return -1;
   }
+
+  /* second argument optionnel : 1 pour démarrer les fils en work-first */
+  thread_attr_init(&attr);
+  if (argc > 2 && atoi(argv[2]))
+    thread_attr_setspawnmode(&attr, THREAD_SPAWN_WORK_FIRST);
   
   length = atoi(argv[1]);
   T = malloc(length*sizeof(TYPE));
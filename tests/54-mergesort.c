@@ -7,6 +7,7 @@
 #define NOTHREADS 2
 
 int *a;
+static thread_attr_t attr;
 
 typedef struct node {
   int begin;
@@ -63,9 +64,9 @@ void * mergesort(void *a)
 
   if (p->begin >= p->end) return NULL;
 
-  ret = thread_create(&tid1, mergesort, (void*)(&n1));
+  ret = thread_create_attr(&tid1, &attr, mergesort, (void*)(&n1));
   assert(!ret);
-  ret = thread_create(&tid2,  mergesort, (void*)(&n2));
+  ret = thread_create_attr(&tid2, &attr, mergesort, (void*)(&n2));
   assert(!ret);
 
   ret = thread_join(tid1, &res1);
@@ -88,6 +89,11 @@ int main(int argc, char * argv[])
     return -1;
   }
 
+  /* second argument optionnel : 1 pour démarrer les fils en work-first */
+  thread_attr_init(&attr);
+  if (argc > 2 && atoi(argv[2]))
+    thread_attr_setspawnmode(&attr, THREAD_SPAWN_WORK_FIRST);
+
 
   int nb_elements = atoi(argv[1]);
   /* mx value d'un int */
@@ -112,6 +118,12 @@ int main(int argc, char * argv[])
   for (i = 0; i < nb_elements; i++)
     a[i] = rand_a_b(0,nb_elements);
 
+  /* merge() recopie le sous-tableau sur la pile */
+  if (nb_elements * sizeof(int) > 16*1024) {
+    ret = thread_setstacksize(nb_elements * sizeof(int) + 32*1024, NULL);
+    assert(!ret);
+  }
+
   ret=thread_create(&tid, mergesort, &m);
   assert(!ret);
 
@@ -0,0 +1,63 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include "thread.h"
+
+/* des threads qui ne rendent jamais la main occupent tous les threads
+ * noyaux. Le thread qui doit les arrêter attend qu'ils aient tous démarré :
+ * sans préemption, il ne reprend jamais la main et le test ne termine pas.
+ */
+
+static volatile int stop = 0;
+static int started = 0;
+static int nb;
+
+static void * hog(void *_value)
+{
+  __sync_fetch_and_add(&started, 1);
+  while (!stop)
+    ;
+
+  return _value;
+}
+
+static void * stopper(void *_value)
+{
+  while (started < nb)
+    thread_yield();
+  stop = 1;
+  return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+  thread_t *th, st;
+  int i, err;
+  void *res;
+
+  err = thread_settimeslice(argc < 2 ? 1000 : atoi(argv[1]), NULL);
+  assert(!err);
+
+  nb = thread_getconcurrency();
+  th = malloc(nb * sizeof(thread_t));
+  assert(th);
+
+  for (i = 0; i < nb; i++) {
+    err = thread_create(&th[i], hog, (void*)(long) i);
+    assert(!err);
+  }
+  err = thread_create(&st, stopper, NULL);
+  assert(!err);
+
+  for (i = 0; i < nb; i++) {
+    err = thread_join(th[i], &res);
+    assert(!err);
+    assert(res == (void*)(long) i);
+  }
+  err = thread_join(st, NULL);
+  assert(!err);
+
+  printf("%d threads préemptés arrêtés\n", nb);
+  free(th);
+  return 0;
+}
@@ -0,0 +1,83 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include "thread.h"
+
+/* à lancer avec THREAD_KTHREADS=1 pour que l'ordre d'exécution soit
+ * déterministe.
+ * - les threads de haute priorité passent avant ceux de basse priorité
+ *   créés avant eux ;
+ * - un thread de basse priorité finit par passer devant un thread de haute
+ *   priorité qui ne fait que céder la main (vieillissement).
+ */
+
+#define NB 10
+
+static int order[2*NB];
+static int pos = 0;
+static volatile int done = 0;
+
+static void * f(void *_value)
+{
+  order[__sync_fetch_and_add(&pos, 1)] = thread_getpriority(thread_self());
+  return _value;
+}
+
+static void * g(void *_value)
+{
+  done = 1;
+  return _value;
+}
+
+int main(int argc, char *argv[])
+{
+  thread_t th[2*NB];
+  int i, err;
+  long n;
+
+  assert(-1 == thread_setpriority(thread_self(), THREAD_PRIO_MAX + 1));
+  assert(THREAD_PRIO_DEFAULT == thread_getpriority(thread_self()));
+
+  /* NB threads de basse priorité puis NB de haute priorité */
+  err = thread_setpriority(thread_self(), THREAD_PRIO_MIN);
+  assert(!err);
+  for (i = 0; i < NB; i++) {
+    err = thread_create(&th[i], f, NULL);
+    assert(!err);
+  }
+  err = thread_setpriority(thread_self(), THREAD_PRIO_MAX);
+  assert(!err);
+  for (i = NB; i < 2*NB; i++) {
+    err = thread_create(&th[i], f, NULL);
+    assert(!err);
+  }
+
+  for (i = 0; i < 2*NB; i++) {
+    err = thread_join(th[i], NULL);
+    assert(!err);
+  }
+
+  if (1 == thread_getconcurrency()) {
+    for (i = 0; i < 2*NB; i++) {
+      assert(order[i] == (i < NB ? THREAD_PRIO_MAX : THREAD_PRIO_MIN));
+    }
+  }
+
+  /* vieillissement */
+  err = thread_setpriority(thread_self(), THREAD_PRIO_MIN);
+  assert(!err);
+  err = thread_create(&th[0], g, NULL);
+  assert(!err);
+  err = thread_setpriority(thread_self(), THREAD_PRIO_MAX);
+  assert(!err);
+
+  for (n = 0; !done; n++) {
+    thread_yield();
+    assert(n < 1000000);
+  }
+  err = thread_join(th[0], NULL);
+  assert(!err);
+
+  printf("thread de basse priorité exécuté après %ld yield\n", n);
+  return 0;
+}
@@ -0,0 +1,63 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "thread.h"
+
+/* taille de pile par thread et page de garde.
+ * - un thread dont la pile fait 1 Mo peut récurser sur 512 Ko ;
+ * - un thread qui déborde de sa pile meurt d'une erreur de segmentation
+ *   (dans un processus fils) au lieu de corrompre la mémoire.
+ */
+
+static long depth(long n)
+{
+  volatile char buf[1024];
+
+  memset((char *) buf, n, sizeof buf);
+  if (n <= 0)
+    return buf[0];
+  return depth(n - 1) + buf[n % sizeof buf];
+}
+
+static void * f(void *_value)
+{
+  return (void *) depth((long) _value);
+}
+
+int main(int argc, char *argv[])
+{
+  thread_t th;
+  int err, status;
+  size_t old;
+  pid_t pid;
+
+  assert(-1 == thread_setstacksize(1024, NULL));
+
+  err = thread_setstacksize(1024*1024, &old);
+  assert(!err);
+  err = thread_create(&th, f, (void *) 512L);
+  assert(!err);
+  err = thread_join(th, NULL);
+  assert(!err);
+  err = thread_setstacksize(old, NULL);
+  assert(!err);
+
+  pid = fork();
+  assert(pid >= 0);
+  if (0 == pid) {
+    /* 1 Mo de récursion sur une pile de 32 Ko */
+    thread_create(&th, f, (void *) 1024L);
+    thread_join(th, NULL);
+    _exit(0);
+  }
+
+  assert(pid == waitpid(pid, &status, 0));
+  assert(WIFSIGNALED(status) && SIGSEGV == WTERMSIG(status));
+
+  printf("débordement de pile détecté\n");
+  return 0;
+}
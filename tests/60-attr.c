@@ -0,0 +1,99 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include "thread.h"
+
+/* test des attributs de création.
+ *
+ * support nécessaire:
+ * - thread_attr_*()
+ * - thread_create_attr()
+ * - thread_join()
+ */
+
+#define NBDETACHED 10000
+
+static char ustack[64*1024] __attribute__((aligned(16)));
+static int count = 0;
+
+static void * onstack(void *_value)
+{
+  char c;
+
+  return (void *) (long) (&c > ustack && &c < ustack + sizeof ustack);
+}
+
+static void * prio(void *_value)
+{
+  return (void *) (long) thread_getpriority(thread_self());
+}
+
+static void * detached(void *_value)
+{
+  __sync_fetch_and_add(&count, 1);
+  return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+  thread_attr_t attr;
+  thread_t th;
+  void *res;
+  int i, err;
+
+  err = thread_attr_init(&attr);
+  assert(!err);
+  assert(-1 == thread_attr_setstacksize(&attr, 10));
+  assert(-1 == thread_attr_setpriority(&attr, THREAD_PRIO_MAX + 1));
+  assert(-1 == thread_attr_setdetachstate(&attr, 42));
+
+  /* pile fournie par l'appelant */
+  err = thread_attr_setstack(&attr, ustack, sizeof ustack);
+  assert(!err);
+  err = thread_create_attr(&th, &attr, onstack, NULL);
+  assert(!err);
+  err = thread_join(th, &res);
+  assert(!err);
+  assert(res == (void *) 1L);
+
+  /* priorité */
+  err = thread_attr_init(&attr);
+  assert(!err);
+  err = thread_attr_setpriority(&attr, THREAD_PRIO_MIN);
+  assert(!err);
+  err = thread_create_attr(&th, &attr, prio, NULL);
+  assert(!err);
+  err = thread_join(th, &res);
+  assert(!err);
+  assert(res == (void *) (long) THREAD_PRIO_MIN);
+
+  /* un thread sur chaque thread noyau */
+  for (i = 0; i < thread_getconcurrency(); i++) {
+    err = thread_attr_init(&attr);
+    assert(!err);
+    err = thread_attr_setkthread(&attr, i);
+    assert(!err);
+    err = thread_create_attr(&th, &attr, prio, NULL);
+    assert(!err);
+    err = thread_join(th, NULL);
+    assert(!err);
+  }
+  err = thread_attr_setkthread(&attr, thread_getconcurrency());
+  assert(!err);
+  assert(-1 == thread_create_attr(&th, &attr, prio, NULL));
+
+  /* threads détachés */
+  err = thread_attr_init(&attr);
+  assert(!err);
+  err = thread_attr_setdetachstate(&attr, THREAD_CREATE_DETACHED);
+  assert(!err);
+  for (i = 0; i < NBDETACHED; i++) {
+    err = thread_create_attr(NULL, &attr, detached, NULL);
+    assert(!err);
+  }
+  while (__sync_fetch_and_add(&count, 0) < NBDETACHED)
+    thread_yield();
+
+  printf("%d threads détachés terminés\n", NBDETACHED);
+  return 0;
+}
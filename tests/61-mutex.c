@@ -0,0 +1,74 @@
+#include <stdio.h>
+#include <assert.h>
+#include <stdlib.h>
+#include "thread.h"
+
+/* test de mutex: plein de threads incrémentent un compteur partagé en
+ * passant la main au milieu de la section critique.
+ *
+ * le compteur final doit valoir nombre de threads * nombre d'incréments.
+ *
+ * support nécessaire:
+ * - thread_create()
+ * - thread_join()
+ * - thread_mutex_lock() et thread_mutex_unlock()
+ */
+
+static thread_mutex_t mutex = THREAD_MUTEX_INITIALIZER;
+static unsigned long counter = 0;
+
+static void * thfunc(void *_nbincr)
+{
+  unsigned long nbincr = (unsigned long) _nbincr;
+  unsigned long i, tmp;
+
+  for(i=0; i<nbincr; i++) {
+    thread_mutex_lock(&mutex);
+    tmp = counter;
+    thread_yield();
+    counter = tmp + 1;
+    thread_mutex_unlock(&mutex);
+  }
+  return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+  int nbth, i, err;
+  unsigned long nbincr;
+  thread_t *ths;
+
+  if (argc < 3) {
+    printf("arguments manquants: nombre de threads, puis nombre d'incréments\n");
+    return -1;
+  }
+
+  nbth = atoi(argv[1]);
+  nbincr = atoi(argv[2]);
+
+  ths = malloc(nbth * sizeof(thread_t));
+  assert(ths);
+
+  for(i=0; i<nbth; i++) {
+    err = thread_create(&ths[i], thfunc, (void*) nbincr);
+    assert(!err);
+  }
+
+  for(i=0; i<nbth; i++) {
+    err = thread_join(ths[i], NULL);
+    assert(!err);
+  }
+
+  assert(counter == nbth * nbincr);
+  assert(thread_mutex_trylock(&mutex) == 0);
+  assert(thread_mutex_trylock(&mutex) == -1);
+  assert(thread_mutex_destroy(&mutex) == -1);
+  thread_mutex_unlock(&mutex);
+  assert(thread_mutex_destroy(&mutex) == 0);
+
+  printf("%d threads x %ld incréments = %ld\n", nbth, nbincr, counter);
+
+  free(ths);
+
+  return 0;
+}
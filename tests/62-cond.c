@@ -0,0 +1,117 @@
+#include <stdio.h>
+#include <assert.h>
+#include <stdlib.h>
+#include "thread.h"
+
+/* test de variables de condition: des producteurs et des consommateurs
+ * s'échangent des entiers par un tampon borné.
+ *
+ * la somme des valeurs consommées doit être égale à celle des valeurs
+ * produites.
+ *
+ * support nécessaire:
+ * - thread_create()
+ * - thread_join() avec récupération de la valeur de retour
+ * - thread_mutex_lock() et thread_mutex_unlock()
+ * - thread_cond_wait(), thread_cond_signal() et thread_cond_broadcast()
+ */
+
+#define SIZE 4
+
+static thread_mutex_t mutex = THREAD_MUTEX_INITIALIZER;
+static thread_cond_t notfull = THREAD_COND_INITIALIZER;
+static thread_cond_t notempty = THREAD_COND_INITIALIZER;
+
+static unsigned long buffer[SIZE];
+static int count = 0, in = 0, out = 0;
+static int done = 0;
+
+static void * producer(void *_nb)
+{
+  unsigned long nb = (unsigned long) _nb;
+  unsigned long i;
+
+  for(i=1; i<=nb; i++) {
+    thread_mutex_lock(&mutex);
+    while (count == SIZE)
+      thread_cond_wait(&notfull, &mutex);
+    buffer[in] = i;
+    in = (in+1) % SIZE;
+    count++;
+    thread_cond_signal(&notempty);
+    thread_mutex_unlock(&mutex);
+  }
+  return NULL;
+}
+
+static void * consumer(void *dummy)
+{
+  unsigned long sum = 0;
+
+  thread_mutex_lock(&mutex);
+  while (1) {
+    while (count == 0 && !done)
+      thread_cond_wait(&notempty, &mutex);
+    if (count == 0 && done)
+      break;
+    sum += buffer[out];
+    out = (out+1) % SIZE;
+    count--;
+    thread_cond_signal(&notfull);
+  }
+  thread_mutex_unlock(&mutex);
+
+  return (void*) sum;
+}
+
+int main(int argc, char *argv[])
+{
+  int nbth, i, err;
+  unsigned long nb, sum = 0;
+  thread_t *prods, *conss;
+  void *res;
+
+  if (argc < 3) {
+    printf("arguments manquants: nombre de producteurs/consommateurs, puis nombre de valeurs par producteur\n");
+    return -1;
+  }
+
+  nbth = atoi(argv[1]);
+  nb = atoi(argv[2]);
+
+  prods = malloc(nbth * sizeof(thread_t));
+  conss = malloc(nbth * sizeof(thread_t));
+  assert(prods && conss);
+
+  for(i=0; i<nbth; i++) {
+    err = thread_create(&conss[i], consumer, NULL);
+    assert(!err);
+    err = thread_create(&prods[i], producer, (void*) nb);
+    assert(!err);
+  }
+
+  for(i=0; i<nbth; i++) {
+    err = thread_join(prods[i], NULL);
+    assert(!err);
+  }
+
+  thread_mutex_lock(&mutex);
+  done = 1;
+  thread_cond_broadcast(&notempty);
+  thread_mutex_unlock(&mutex);
+
+  for(i=0; i<nbth; i++) {
+    err = thread_join(conss[i], &res);
+    assert(!err);
+    sum += (unsigned long) res;
+  }
+
+  assert(sum == nbth * nb * (nb+1) / 2);
+  assert(thread_cond_destroy(&notempty) == 0);
+  printf("%d producteurs et %d consommateurs: somme = %ld\n", nbth, nbth, sum);
+
+  free(prods);
+  free(conss);
+
+  return 0;
+}
@@ -0,0 +1,91 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <sys/resource.h>
+#include "thread.h"
+
+/* test de threads détachés: plein de threads créés puis détachés, avant
+ * ou après leur fin, sans jamais être joints.
+ *
+ * la mémoire utilisée ne doit pas dépendre du nombre de threads.
+ *
+ * support nécessaire:
+ * - thread_create()
+ * - thread_detach()
+ * - thread_yield()
+ */
+
+#define BATCH 100
+
+static int count = 0;
+
+static void * thfunc(void *dummy)
+{
+  __sync_fetch_and_add(&count, 1);
+  return NULL;
+}
+
+/* attendre que tous les threads créés jusqu'ici aient terminé */
+static void wait_count(int n)
+{
+  while (__sync_fetch_and_add(&count, 0) < n)
+    thread_yield();
+}
+
+static long maxrss(void)
+{
+  struct rusage ru;
+
+  getrusage(RUSAGE_SELF, &ru);
+  return ru.ru_maxrss;
+}
+
+static void run(int nb)
+{
+  thread_t th;
+  int i, err, base = count;
+
+  for (i = 0; i < nb; i++) {
+    err = thread_create(&th, thfunc, NULL);
+    assert(!err);
+
+    if (i % 2) {
+      /* détaché avant la fin */
+      err = thread_detach(th);
+      assert(!err);
+    } else {
+      /* détaché après la fin */
+      wait_count(base + i + 1);
+      err = thread_detach(th);
+      assert(!err);
+    }
+
+    if (0 == i % BATCH)
+      wait_count(base + i + 1);
+  }
+  wait_count(base + nb);
+}
+
+int main(int argc, char *argv[])
+{
+  int nb;
+  long rss1, rss2;
+
+  if (argc < 2) {
+    printf("argument manquant: nombre de threads\n");
+    return -1;
+  }
+
+  nb = atoi(argv[1]);
+
+  assert(-1 == thread_detach(thread_self()));
+
+  run(nb / 10);
+  rss1 = maxrss();
+  run(nb);
+  rss2 = maxrss();
+
+  printf("%d threads détachés: %ld Ko -> %ld Ko\n", nb + nb / 10, rss1, rss2);
+  assert(rss2 - rss1 < 4096);
+  return 0;
+}
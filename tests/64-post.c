@@ -0,0 +1,184 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <sys/time.h>
+#include <pthread.h>
+#include "thread.h"
+
+/* test des tâches sans pile: le thread principal poste plein de petites
+ * tâches et attend qu'elles soient toutes faites, puis des threads postent
+ * chacun les leurs en parallèle. Certaines tâches en postent d'autres. Un
+ * pthread extérieur à la bibliothèque attend aussi des tâches. Enfin
+ * NBBIG tâches utilisant 48 Ko de pile sont exécutées par les threads noyau
+ * pendant que le thread principal passe la main.
+ *
+ * une tâche doit coûter à peu près un appel de fonction.
+ *
+ * support nécessaire:
+ * - thread_post()
+ * - thread_post_wait()
+ * - thread_create()
+ * - thread_join()
+ */
+
+#define NBTHREADS 8
+#define NBBIG 1000
+
+static int nb;
+static char *done;
+
+static void task(void *arg)
+{
+  long i = (long) arg;
+
+  assert(!done[i]);
+  done[i] = 1;
+}
+
+/* une tâche qui en poste une autre, sur le même compteur */
+struct bundle {
+  unsigned long *counter;
+  long i;
+};
+
+static struct bundle *bundles;
+
+static void nested(void *arg)
+{
+  struct bundle *b = arg;
+
+  task((void *) b->i);
+  thread_post(task, (void *) (b->i + 1), b->counter);
+}
+
+/* une tâche gourmande en pile, plus que les 32 Ko des threads */
+static void big(void *arg)
+{
+  volatile char buf[48 * 1024];
+
+  memset((char *) buf, 1, sizeof buf);
+  task((void *) ((long) arg + buf[0] - 1));
+}
+
+static void check(void)
+{
+  int i;
+
+  for (i = 0; i < nb; i++)
+    assert(done[i]);
+}
+
+/* la première tâche attend que le pthread soit en train d'attendre */
+static volatile int waiting;
+
+static void hold(void *arg)
+{
+  while (!waiting)
+    ;
+  task(arg);
+}
+
+static void * foreign(void *arg)
+{
+  waiting = 1;
+  thread_post_wait(arg);
+  assert(!*(unsigned long *) arg);
+  check();
+  return NULL;
+}
+
+static void * thfunc(void *arg)
+{
+  long k = (long) arg, i;
+  unsigned long counter = 0;
+
+  for (i = k; i < nb; i += NBTHREADS)
+    thread_post(task, (void *) i, &counter);
+  thread_post_wait(&counter);
+  assert(!counter);
+  return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+  struct timeval tv1, tv2;
+  unsigned long counter = 0;
+  thread_t th[NBTHREADS];
+  pthread_t pth;
+  double us;
+  long i;
+  int err;
+
+  if (argc < 2) {
+    printf("argument manquant: nombre de tâches\n");
+    return -1;
+  }
+
+  nb = atoi(argv[1]) & ~1;
+  done = calloc(nb, 1);
+  bundles = malloc(nb / 2 * sizeof *bundles);
+
+  /* depuis le thread principal */
+  gettimeofday(&tv1, NULL);
+  for (i = 0; i < nb; i++)
+    thread_post(task, (void *) i, &counter);
+  thread_post_wait(&counter);
+  gettimeofday(&tv2, NULL);
+  assert(!counter);
+  check();
+
+  us = (tv2.tv_sec - tv1.tv_sec) * 1e6 + (tv2.tv_usec - tv1.tv_usec);
+  printf("%d tâches en %g us (%g ns par tâche)\n", nb, us, us * 1000 / nb);
+
+  /* depuis plusieurs threads */
+  for (i = 0; i < nb; i++)
+    done[i] = 0;
+  for (i = 0; i < NBTHREADS; i++) {
+    err = thread_create(&th[i], thfunc, (void *) i);
+    assert(!err);
+  }
+  for (i = 0; i < NBTHREADS; i++) {
+    err = thread_join(th[i], NULL);
+    assert(!err);
+  }
+  check();
+
+  /* des tâches qui en postent d'autres */
+  for (i = 0; i < nb; i++)
+    done[i] = 0;
+  for (i = 0; i < nb / 2; i++) {
+    bundles[i].counter = &counter;
+    bundles[i].i = 2 * i;
+    thread_post(nested, &bundles[i], &counter);
+  }
+  thread_post_wait(&counter);
+  assert(!counter);
+  check();
+
+  /* attendues aussi depuis un pthread */
+  for (i = 0; i < nb; i++)
+    done[i] = 0;
+  thread_post(hold, (void *) 0, &counter);
+  for (i = 1; i < nb; i++)
+    thread_post(task, (void *) i, &counter);
+  err = pthread_create(&pth, NULL, foreign, &counter);
+  assert(!err);
+  thread_post_wait(&counter);
+  err = pthread_join(pth, NULL);
+  assert(!err);
+  check();
+
+  /* exécutées par les threads noyau, sur leur pile */
+  for (i = 0; i < nb; i++)
+    done[i] = 0;
+  for (i = 0; i < nb; i++)
+    thread_post(i < NBBIG ? big : task, (void *) i, &counter);
+  while (counter)
+    thread_yield();
+  check();
+
+  free(bundles);
+  free(done);
+  return 0;
+}
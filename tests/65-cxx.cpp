@@ -0,0 +1,114 @@
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+#include "thread.hpp"
+
+/* test de l'interface C++: somme d'un tableau et fibonacci avec des
+ * fermetures typées, résultat non copiable, exception relancée par join,
+ * grosse fermeture (allouée sur le tas), tâche jamais jointe, attributs
+ * demandant un thread détaché et tâche annulée.
+ *
+ * support nécessaire:
+ * - thread_create_attr(), thread_attr_setdetachstate()
+ * - thread_join()
+ * - thread_cancel()
+ */
+
+static long sum(const int *a, int n)
+{
+  if (n == 1)
+    return a[0];
+
+  auto left = uthread::spawn([=] { return sum(a, n / 2); });
+  long right = sum(a + n / 2, n - n / 2);
+  return left.join() + right;
+}
+
+static int fibo(int n)
+{
+  int x, y;
+
+  if (n < 2)
+    return n;
+
+  uthread::parallel_invoke([&] { x = fibo(n - 1); }, [&] { y = fibo(n - 2); });
+  return x + y;
+}
+
+int main(int argc, char *argv[])
+{
+  int n, i;
+
+  if (argc < 2) {
+    printf("argument manquant: taille du tableau\n");
+    return -1;
+  }
+
+  n = atoi(argv[1]);
+  std::vector<int> a(n);
+  for (i = 0; i < n; i++)
+    a[i] = i + 1;
+
+  long s = sum(a.data(), n);
+  printf("somme des entiers de 1 à %d = %ld\n", n, s);
+  assert(s == (long) n * (n + 1) / 2);
+
+  int f = fibo(15);
+  printf("fibo(15) = %d\n", f);
+  assert(f == 610);
+
+  /* résultat déplacé */
+  auto p = uthread::spawn([] { return std::make_unique<int>(42); });
+  std::unique_ptr<int> r = p.join();
+  assert(*r == 42);
+
+  /* exception */
+  auto e = uthread::spawn([]() -> int { throw std::runtime_error("perdu"); });
+  try {
+    e.join();
+    assert(0);
+  } catch (const std::runtime_error &err) {
+    printf("exception relancée par join: %s\n", err.what());
+  }
+
+  /* fermeture trop grande pour la tâche */
+  char big[THREAD_CLOSURE_SIZE * 2] = { 1 };
+  auto b = uthread::spawn([big] { return (int) big[0]; });
+  assert(b.join() == 1);
+
+  /* jamais jointe: le destructeur attend */
+  int done = 0;
+  {
+    auto t = uthread::spawn([&] { thread_yield(); done = 1; });
+  }
+  assert(done);
+
+  /* détaché demandé: la tâche reste joignable */
+  thread_attr_t attr;
+  thread_attr_init(&attr);
+  thread_attr_setdetachstate(&attr, THREAD_CREATE_DETACHED);
+  auto d = uthread::spawn(attr, [] { thread_yield(); return 7; });
+  assert(d.join() == 7);
+
+  /* annulée: join lève une exception, la fermeture est détruite */
+  auto owned = std::make_shared<int>(0);
+  auto c = uthread::spawn([owned] {
+    while (1)
+      thread_yield();
+    return *owned;
+  });
+  thread_yield();
+  thread_cancel(c.native_handle());
+  try {
+    c.join();
+    assert(0);
+  } catch (const std::runtime_error &err) {
+    printf("tâche annulée: %s\n", err.what());
+  }
+  assert(owned.use_count() == 1);
+
+  return 0;
+}
@@ -0,0 +1,111 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "thread.h"
+
+/* test de thread_create_copy: le créateur réutilise ses arguments dès le
+ * retour, avec un petit argument (gardé dans le descripteur) et un gros
+ * (en haut de la pile). La somme récursive passe ses bornes par copie,
+ * sans structure à garder en vie sur la pile du parent.
+ *
+ * support nécessaire:
+ * - thread_create_copy()
+ * - thread_join() avec récupération de la valeur de retour
+ */
+
+struct range {
+  int *array;
+  int start;
+  int end;
+};
+
+struct big {
+  int n;
+  char data[300];
+};
+
+static void * sum(void *arg)
+{
+  struct range *r = arg, sub;
+  thread_t th1, th2;
+  void *res1, *res2;
+  int err;
+
+  if (r->start == r->end)
+    return (void *) (long) r->array[r->start];
+
+  /* la même structure sert aux deux fils */
+  sub = *r;
+  sub.end = r->start + (r->end - r->start) / 2;
+  err = thread_create_copy(&th1, sum, &sub, sizeof sub);
+  assert(!err);
+  sub.start = sub.end + 1;
+  sub.end = r->end;
+  err = thread_create_copy(&th2, sum, &sub, sizeof sub);
+  assert(!err);
+  memset(&sub, 0, sizeof sub);
+
+  err = thread_join(th1, &res1);
+  assert(!err);
+  err = thread_join(th2, &res2);
+  assert(!err);
+
+  return (void *) ((long) res1 + (long) res2);
+}
+
+static void * check_big(void *arg)
+{
+  struct big *b = arg;
+  int i;
+
+  thread_yield();
+  for (i = 0; i < (int) sizeof b->data; i++)
+    assert(b->data[i] == (char) (b->n + i));
+  return (void *) (long) b->n;
+}
+
+int main(int argc, char *argv[])
+{
+  struct range r;
+  struct big b;
+  thread_t th[10];
+  void *res;
+  int i, j, n, err;
+  char huge[THREAD_COPY_MAX + 1];
+
+  if (argc < 2) {
+    printf("argument manquant: taille du tableau\n");
+    return -1;
+  }
+
+  n = atoi(argv[1]);
+  r.array = malloc(n * sizeof *r.array);
+  for (i = 0; i < n; i++)
+    r.array[i] = i + 1;
+  r.start = 0;
+  r.end = n - 1;
+
+  res = sum(&r);
+  printf("somme des entiers de 1 à %d = %ld\n", n, (long) res);
+  assert((long) res == (long) n * (n + 1) / 2);
+
+  for (i = 0; i < 10; i++) {
+    b.n = i;
+    for (j = 0; j < (int) sizeof b.data; j++)
+      b.data[j] = (char) (i + j);
+    err = thread_create_copy(&th[i], check_big, &b, sizeof b);
+    assert(!err);
+  }
+  memset(&b, 0, sizeof b);
+  for (i = 0; i < 10; i++) {
+    err = thread_join(th[i], &res);
+    assert(!err);
+    assert((long) res == i);
+  }
+
+  assert(-1 == thread_create_copy(&th[0], check_big, huge, sizeof huge));
+
+  free(r.array);
+  return 0;
+}
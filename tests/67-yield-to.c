@@ -0,0 +1,101 @@
+#include <stdio.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include "thread.h"
+
+/* test de thread_yield_to: le main et un thread se renvoient la balle
+ * pendant que d'autres threads font des thread_yield. Avec un seul thread
+ * noyau, la balle doit passer directement de l'un à l'autre, sans que les
+ * autres threads ne s'intercalent.
+ *
+ * support nécessaire:
+ * - thread_create()
+ * - thread_yield_to()
+ * - thread_join()
+ */
+
+#define NBOTHERS 10
+
+static volatile int stop = 0;
+static volatile unsigned long others = 0;
+static volatile int turn = 0;
+static int nbrounds;
+static thread_t mainth;
+
+static void * busy(void *dummy)
+{
+  while (!stop) {
+    others++;
+    thread_yield();
+  }
+  return NULL;
+}
+
+static void * pong(void *dummy)
+{
+  int i;
+
+  for (i = 0; i < nbrounds; i++) {
+    while (turn != 1)
+      thread_yield_to(mainth);
+    turn = 0;
+    thread_yield_to(mainth);
+  }
+  return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+  thread_t th, ths[NBOTHERS];
+  struct timeval tv1, tv2;
+  unsigned long us, before;
+  int i, err;
+
+  if (argc < 2) {
+    printf("argument manquant: nombre d'échanges\n");
+    return -1;
+  }
+
+  nbrounds = atoi(argv[1]);
+  mainth = thread_self();
+
+  for (i = 0; i < NBOTHERS; i++) {
+    err = thread_create(&ths[i], busy, NULL);
+    assert(!err);
+  }
+  err = thread_create(&th, pong, NULL);
+  assert(!err);
+
+  /* laisser tout le monde démarrer */
+  for (i = 0; i < 2 * NBOTHERS; i++)
+    thread_yield();
+
+  before = others;
+  gettimeofday(&tv1, NULL);
+  for (i = 0; i < nbrounds; i++) {
+    turn = 1;
+    thread_yield_to(th);
+    while (turn != 0)
+      thread_yield_to(th);
+  }
+  gettimeofday(&tv2, NULL);
+
+  us = (tv2.tv_sec-tv1.tv_sec)*1000000+(tv2.tv_usec-tv1.tv_usec);
+  printf("%d échanges en %lu us (%g ns par thread_yield_to), "
+         "%lu yields des autres threads\n",
+         nbrounds, us, us * 1000.0 / (2 * nbrounds), others - before);
+
+  if (getenv("THREAD_KTHREADS") && 1 == atoi(getenv("THREAD_KTHREADS")))
+    assert(others == before);
+
+  stop = 1;
+  err = thread_join(th, NULL);
+  assert(!err);
+  for (i = 0; i < NBOTHERS; i++) {
+    err = thread_join(ths[i], NULL);
+    assert(!err);
+  }
+
+  return 0;
+}
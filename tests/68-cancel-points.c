@@ -0,0 +1,250 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include "thread.h"
+
+/* test des points d'annulation et des gestionnaires de nettoyage:
+ * - une boucle de calcul qui ne rend jamais la main (préemptée), annulée par
+ *   thread_testcancel, avec deux gestionnaires appelés dans l'ordre inverse,
+ * - un thread dans thread_post_wait qui trouve toujours une tâche à
+ *   exécuter et ne passe donc jamais la main, annulé par l'une d'elles,
+ * - un thread bloqué dans thread_join, réveillé par l'annulation alors que
+ *   celui qu'il attend tourne toujours (et reste joignable),
+ * - un thread bloqué dans thread_cond_wait, dont le gestionnaire rend le
+ *   mutex, que la condition soit signalée ensuite ou jamais,
+ * - des threads annulés avant d'avoir démarré, qui ne s'exécutent jamais
+ *   avec un seul thread noyau.
+ *
+ * support nécessaire:
+ * - thread_create(), thread_join(), thread_cancel()
+ * - thread_testcancel(), thread_cleanup_push(), thread_cleanup_pop()
+ * - thread_settimeslice()
+ * - thread_post(), thread_post_wait()
+ * - thread_mutex_*(), thread_cond_*()
+ */
+
+#define NBQUEUED 100
+
+static volatile int go = 0;
+static volatile int started = 0;
+static volatile int order = 0;
+static volatile int ran = 0;
+static thread_mutex_t mutex = THREAD_MUTEX_INITIALIZER;
+static thread_cond_t cond = THREAD_COND_INITIALIZER;
+static thread_cond_t silent = THREAD_COND_INITIALIZER; /* jamais signalée */
+static unsigned long endless;
+static thread_t posting;
+
+static void first(void *arg)
+{
+  /* appelé en dernier */
+  assert(order == 1);
+  order = 2;
+}
+
+static void second(void *arg)
+{
+  assert(order == 0);
+  order = 1;
+}
+
+static void unused(void *arg)
+{
+  assert(0);
+}
+
+static void * spin(void *arg)
+{
+  unsigned long i = 0;
+
+  thread_cleanup_push(unused, NULL);
+  thread_cleanup_pop(0);
+
+  thread_cleanup_push(first, NULL);
+  thread_cleanup_push(second, NULL);
+  started = 1;
+  while (1) {
+    if (0 == ++i % 1000)
+      thread_testcancel();
+  }
+  thread_cleanup_pop(0);
+  thread_cleanup_pop(0);
+  return NULL;
+}
+
+/* une tâche qui se reposte 1000 fois, la 500e annule le thread qui les
+ * attend */
+static void again(void *arg)
+{
+  long n = (long) arg;
+
+  if (n == 500)
+    thread_cancel(posting);
+  if (n < 1000)
+    thread_post(again, (void *) (n + 1), &endless);
+}
+
+static void * post_waiter(void *arg)
+{
+  thread_post(again, NULL, &endless);
+  thread_post_wait(&endless);
+  assert(0);
+  return NULL;
+}
+
+static void * forever(void *arg)
+{
+  while (!go)
+    thread_yield();
+  return (void *) 42;
+}
+
+static void * joiner(void *arg)
+{
+  void *res;
+
+  started = 1;
+  thread_join((thread_t) arg, &res);
+  assert(0);
+  return NULL;
+}
+
+static void unlock(void *arg)
+{
+  thread_mutex_unlock(arg);
+}
+
+static void * waiter(void *arg)
+{
+  thread_mutex_lock(&mutex);
+  thread_cleanup_push(unlock, &mutex);
+  started = 1;
+  while (1)
+    thread_cond_wait(arg, &mutex);
+  thread_cleanup_pop(1);
+  return NULL;
+}
+
+static void * never(void *arg)
+{
+  ran++;
+  while (!go)
+    thread_yield();
+  return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+  thread_t th, th2, ths[NBQUEUED];
+  thread_attr_t attr;
+  void *res;
+  int i, err;
+
+  /* boucle de calcul: la préemption rend la main au main */
+  thread_settimeslice(1000, NULL);
+  err = thread_create(&th, spin, NULL);
+  assert(!err);
+  while (!started)
+    thread_yield();
+  thread_cancel(th);
+  err = thread_join(th, &res);
+  assert(!err);
+  assert(res == THREAD_CANCELED);
+  assert(order == 2);
+  thread_settimeslice(0, NULL);
+  printf("boucle de calcul annulée, gestionnaires appelés\n");
+
+  /* thread_post_wait occupé par des tâches */
+  err = thread_create(&posting, post_waiter, NULL);
+  assert(!err);
+  err = thread_join(posting, &res);
+  assert(!err);
+  assert(res == THREAD_CANCELED);
+  thread_post_wait(&endless);
+  printf("thread_post_wait annulé\n");
+
+  /* thread bloqué dans thread_join */
+  started = 0;
+  err = thread_create(&th2, forever, NULL);
+  assert(!err);
+  err = thread_create(&th, joiner, th2);
+  assert(!err);
+  while (!started)
+    thread_yield();
+  for (i = 0; i < 10; i++)
+    thread_yield();
+  thread_cancel(th);
+  err = thread_join(th, &res);
+  assert(!err);
+  assert(res == THREAD_CANCELED);
+  go = 1;
+  err = thread_join(th2, &res);
+  assert(!err);
+  assert(res == (void *) 42);
+  printf("thread_join annulé, le thread attendu reste joignable\n");
+
+  /* thread bloqué dans thread_cond_wait */
+  started = 0;
+  err = thread_create(&th, waiter, &cond);
+  assert(!err);
+  while (!started)
+    thread_yield();
+  thread_cancel(th);
+  thread_mutex_lock(&mutex);
+  thread_cond_broadcast(&cond);
+  thread_mutex_unlock(&mutex);
+  err = thread_join(th, &res);
+  assert(!err);
+  assert(res == THREAD_CANCELED);
+  assert(0 == thread_mutex_trylock(&mutex));
+  thread_mutex_unlock(&mutex);
+  printf("thread_cond_wait annulé, mutex rendu\n");
+
+  /* condition jamais signalée: l'annulation seule réveille le thread, qui
+   * attend de reprendre le mutex */
+  for (i = 0; i < 100; i++) {
+    started = 0;
+    err = thread_create(&th, waiter, &silent);
+    assert(!err);
+    while (!started)
+      thread_yield();
+    if (i % 2)
+      thread_mutex_lock(&mutex);
+    thread_cancel(th);
+    if (i % 2)
+      thread_mutex_unlock(&mutex);
+    err = thread_join(th, &res);
+    assert(!err);
+    assert(res == THREAD_CANCELED);
+  }
+  assert(0 == thread_cond_destroy(&silent));
+  assert(0 == thread_mutex_trylock(&mutex));
+  thread_mutex_unlock(&mutex);
+  printf("thread_cond_wait annulé sans signal\n");
+
+  /* threads annulés avant d'avoir démarré, joints ou détachés */
+  go = 0;
+  thread_attr_init(&attr);
+  thread_attr_setdetachstate(&attr, THREAD_CREATE_DETACHED);
+  for (i = 0; i < NBQUEUED; i++) {
+    err = thread_create_attr(&ths[i], i % 2 ? &attr : NULL, never, NULL);
+    assert(!err);
+    if (i % 2)
+      thread_cancel(ths[i]);
+  }
+  for (i = 0; i < NBQUEUED; i += 2)
+    thread_cancel(ths[i]);
+  for (i = 0; i < NBQUEUED; i += 2) {
+    err = thread_join(ths[i], &res);
+    assert(!err);
+    assert(res == THREAD_CANCELED);
+  }
+  go = 1;
+  printf("%d threads annulés avant de démarrer, %d ont démarré\n",
+         NBQUEUED, ran);
+
+  if (getenv("THREAD_KTHREADS") && 1 == atoi(getenv("THREAD_KTHREADS")))
+    assert(ran == 0);
+
+  return 0;
+}
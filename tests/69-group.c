@@ -0,0 +1,175 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <sys/time.h>
+#include "thread.h"
+
+/* test des groupes de threads:
+ * - N threads créés dans un groupe puis attendus en une fois, comparé à N
+ *   thread_join,
+ * - un arbre de threads où chaque thread crée ses fils dans le même groupe,
+ * - l'annulation d'un groupe dont les threads attendent indéfiniment,
+ * - deux threads qui attendent le même groupe: l'un reçoit -1, l'autre
+ *   est annulé pendant son attente, le groupe garde ses threads.
+ *
+ * support nécessaire:
+ * - thread_group_create(), thread_group_wait(), thread_group_cancel()
+ * - thread_create(), thread_join(), thread_cancel()
+ * - thread_setspawnbacklog()
+ */
+
+static thread_group_t tree = THREAD_GROUP_INITIALIZER;
+static unsigned long done = 0;
+static volatile int stop = 0;
+static volatile int busy = 0;
+
+static void * inc(void *arg)
+{
+  __atomic_add_fetch(&done, 1, __ATOMIC_RELAXED);
+  return NULL;
+}
+
+static void * node(void *arg)
+{
+  long depth = (long) arg;
+  int err;
+
+  __atomic_add_fetch(&done, 1, __ATOMIC_RELAXED);
+  if (depth > 0) {
+    err = thread_group_create(&tree, NULL, node, (void *) (depth - 1));
+    assert(!err);
+    err = thread_group_create(&tree, NULL, node, (void *) (depth - 1));
+    assert(!err);
+  }
+  return NULL;
+}
+
+static void * wait_stop(void *arg)
+{
+  while (!stop)
+    thread_yield();
+  __atomic_add_fetch(&done, 1, __ATOMIC_RELAXED);
+  return NULL;
+}
+
+static void * group_waiter(void *arg)
+{
+  int err = thread_group_wait(arg);
+
+  if (-1 == err)
+    busy = 1;
+  return (void *) (long) err;
+}
+
+static unsigned long elapsed(struct timeval *tv1)
+{
+  struct timeval tv2;
+
+  gettimeofday(&tv2, NULL);
+  return (tv2.tv_sec-tv1->tv_sec)*1000000+(tv2.tv_usec-tv1->tv_usec);
+}
+
+int main(int argc, char *argv[])
+{
+  thread_group_t group;
+  thread_t *ths;
+  struct timeval tv1;
+  unsigned long us;
+  void *res[2];
+  int i, n, err;
+
+  if (argc < 2) {
+    printf("argument manquant: nombre de threads\n");
+    return -1;
+  }
+
+  n = atoi(argv[1]);
+  ths = malloc(n * sizeof *ths);
+
+  /* attente en une fois */
+  thread_group_init(&group);
+  gettimeofday(&tv1, NULL);
+  for (i = 0; i < n; i++) {
+    err = thread_group_create(&group, NULL, inc, NULL);
+    assert(!err);
+  }
+  thread_group_wait(&group);
+  us = elapsed(&tv1);
+  assert(done == (unsigned long) n);
+  assert(0 == thread_group_destroy(&group));
+  printf("%d threads d'un groupe en %lu us\n", n, us);
+
+  done = 0;
+  gettimeofday(&tv1, NULL);
+  for (i = 0; i < n; i++) {
+    err = thread_create(&ths[i], inc, NULL);
+    assert(!err);
+  }
+  for (i = 0; i < n; i++) {
+    err = thread_join(ths[i], NULL);
+    assert(!err);
+  }
+  us = elapsed(&tv1);
+  assert(done == (unsigned long) n);
+  printf("%d threads joints un par un en %lu us\n", n, us);
+
+  /* arbre */
+  done = 0;
+  err = thread_group_create(&tree, NULL, node, (void *) 10L);
+  assert(!err);
+  thread_group_wait(&tree);
+  assert(done == (1UL << 11) - 1);
+  printf("arbre de %lu threads attendu\n", done);
+
+  /* annulation: les threads attendent, aucun ne doit être exécuté par son
+   * créateur */
+  thread_setspawnbacklog(0, NULL);
+  done = 0;
+  thread_group_init(&group);
+  for (i = 0; i < n; i++) {
+    err = thread_group_create(&group, NULL, wait_stop, NULL);
+    assert(!err);
+  }
+  for (i = 0; i < 10; i++)
+    thread_yield();
+  thread_group_cancel(&group);
+  thread_group_wait(&group);
+  assert(0 == thread_group_destroy(&group));
+  assert(done == 0);
+  printf("groupe de %d threads annulé\n", n);
+
+  /* deux threads attendent le groupe */
+  done = 0;
+  thread_group_init(&group);
+  for (i = 0; i < 10; i++) {
+    err = thread_group_create(&group, NULL, wait_stop, NULL);
+    assert(!err);
+  }
+  for (i = 0; i < 2; i++) {
+    err = thread_create(&ths[i], group_waiter, &group);
+    assert(!err);
+  }
+  while (!busy)
+    thread_yield();
+  for (i = 0; i < 2; i++)
+    thread_cancel(ths[i]);
+  for (i = 0; i < 2; i++) {
+    err = thread_join(ths[i], &res[i]);
+    assert(!err);
+  }
+  assert((res[0] == (void *) -1L && res[1] == THREAD_CANCELED)
+         || (res[1] == (void *) -1L && res[0] == THREAD_CANCELED));
+  assert(done == 0);
+  stop = 1;
+  assert(0 == thread_group_wait(&group));
+  assert(done == 10);
+  assert(0 == thread_group_destroy(&group));
+  printf("attente du groupe refusée puis annulée\n");
+
+  /* un groupe vide n'attend pas */
+  thread_group_wait(&group);
+  thread_group_cancel(&group);
+
+  free(ths);
+  return 0;
+}
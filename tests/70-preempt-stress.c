@@ -0,0 +1,111 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include "thread.h"
+
+/* stress de la préemption sur plusieurs threads noyaux: avec une tranche de
+ * temps très courte, des threads alternent calcul pur et appels à la
+ * bibliothèque (yield, mutex, création et attente de fils) et migrent d'un
+ * thread noyau à l'autre. La bibliothèque vérifie (assert) que chaque thread
+ * est sorti de toutes ses sections de bibliothèque quand il se termine. Pour
+ * finir, tous les threads tournent sans appel à la bibliothèque: seule la
+ * préemption permet à chacun, et au main, d'avancer.
+ *
+ * support nécessaire:
+ * - thread_settimeslice(), thread_setconcurrency()
+ * - thread_create(), thread_join(), thread_yield()
+ * - thread_mutex_lock(), thread_mutex_unlock()
+ */
+
+#define NBTHREADS 16
+
+static thread_mutex_t mutex = THREAD_MUTEX_INITIALIZER;
+static unsigned long total = 0;
+static int nbiters;
+static volatile int spinning = 0;
+static volatile int stop = 0;
+
+static unsigned long burn(unsigned long n)
+{
+  volatile unsigned long x = 0;
+
+  while (n--)
+    x += n;
+  return x;
+}
+
+static void * child(void *arg)
+{
+  return (void *) burn(100);
+}
+
+static void * worker(void *arg)
+{
+  thread_t th;
+  int i, err;
+
+  for (i = 0; i < nbiters; i++) {
+    burn(500);
+    switch (i % 3) {
+    case 0:
+      thread_yield();
+      break;
+    case 1:
+      thread_mutex_lock(&mutex);
+      total++;
+      burn(50);
+      thread_mutex_unlock(&mutex);
+      break;
+    case 2:
+      err = thread_create(&th, child, NULL);
+      assert(!err);
+      err = thread_join(th, NULL);
+      assert(!err);
+      break;
+    }
+  }
+
+  __atomic_add_fetch(&spinning, 1, __ATOMIC_RELAXED);
+  while (!stop)
+    burn(10);
+
+  return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+  thread_t ths[NBTHREADS];
+  int i, err;
+
+  if (argc < 2) {
+    printf("argument manquant: nombre d'itérations\n");
+    return -1;
+  }
+
+  nbiters = atoi(argv[1]);
+  if (thread_getconcurrency() < 4)
+    thread_setconcurrency(4);
+  thread_settimeslice(100, NULL);
+
+  for (i = 0; i < NBTHREADS; i++) {
+    err = thread_create(&ths[i], worker, NULL);
+    assert(!err);
+  }
+
+  /* sans aucun appel à la bibliothèque */
+  while (spinning < NBTHREADS)
+    burn(10);
+  stop = 1;
+
+  for (i = 0; i < NBTHREADS; i++) {
+    err = thread_join(ths[i], NULL);
+    assert(!err);
+  }
+  thread_settimeslice(0, NULL);
+
+  assert(total == (unsigned long) NBTHREADS * ((nbiters + 1) / 3));
+  printf("%d threads, %d itérations chacun sous préemption sur %d threads "
+         "noyaux\n", NBTHREADS, nbiters, thread_getconcurrency());
+
+  return 0;
+}
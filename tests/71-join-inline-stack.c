@@ -0,0 +1,76 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "thread.h"
+
+/* test de la place sur la pile lors d'un join exécuté sur la pile de celui
+ * qui joint: un thread qui a déjà utilisé de 1 à 6 Ko de sa pile de 32 Ko
+ * joint un thread pas encore démarré qui utilise de 26 à 29 Ko de la sienne.
+ * Le thread joint ne doit pas déborder, qu'il soit exécuté sur sa propre pile
+ * ou sur celle du thread qui le joint. Le main attend que le premier thread
+ * ait démarré sur sa propre pile avant de le joindre.
+ *
+ * le programme doit retourner correctement.
+ *
+ * support nécessaire:
+ * - thread_create()
+ * - thread_join() avec récupération de la valeur de retour
+ * - thread_yield()
+ */
+
+static volatile int started;
+
+static long touch(size_t size)
+{
+  volatile char buf[size];
+
+  memset((char *) buf, 1, size);
+  return buf[0] + buf[size - 1];
+}
+
+static void * child(void *_kb)
+{
+  return (void *) touch((long) _kb * 1024);
+}
+
+static void * parent(void *_kb)
+{
+  long used = (long) _kb / 100, kb = (long) _kb % 100;
+  volatile char buf[used * 1024];
+  thread_t th;
+  void *res;
+  int err;
+
+  started = 1;
+  memset((char *) buf, 1, sizeof buf);
+  err = thread_create(&th, child, (void *) kb);
+  assert(!err);
+  err = thread_join(th, &res);
+  assert(!err);
+  assert(res == (void *) 2L);
+  return (void *) (long) buf[0];
+}
+
+int main(int argc, char *argv[])
+{
+  thread_t th;
+  void *res;
+  long used, kb;
+  int err;
+
+  for (used = 1; used <= 6; used++)
+    for (kb = 26; kb <= 29; kb++) {
+      started = 0;
+      err = thread_create(&th, parent, (void *) (used * 100 + kb));
+      assert(!err);
+      while (!started)
+        thread_yield();
+      err = thread_join(th, &res);
+      assert(!err);
+      assert(res == (void *) 1L);
+    }
+
+  printf("aucun débordement de pile lors des join\n");
+  return 0;
+}
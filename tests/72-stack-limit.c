@@ -0,0 +1,80 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <sys/resource.h>
+#include "thread.h"
+
+/* test du manque de mémoire pour les piles: l'espace d'adressage est limité
+ * à 64 Mo de plus que ce qui est déjà utilisé, puis NB threads avec des piles
+ * de 1 Mo sont créés, qui attendent qu'ils l'aient tous été. Ils ne peuvent
+ * pas tous avoir leur pile en même temps: ceux qui n'en ont pas encore
+ * doivent attendre que les autres terminent au lieu de faire échouer le
+ * programme. La moitié démarre tout de suite après sa création. Les
+ * échecs de mmap sont affichés au passage.
+ *
+ * le programme doit retourner correctement.
+ *
+ * support nécessaire:
+ * - thread_create_attr(), thread_attr_setstacksize(), thread_attr_setspawnmode()
+ * - thread_yield()
+ * - thread_join() avec récupération de la valeur de retour
+ */
+
+#define NB 256
+
+static volatile int go;
+
+static void * thfunc(void *arg)
+{
+  while (!go)
+    thread_yield();
+  return arg;
+}
+
+int main(int argc, char *argv[])
+{
+  thread_t th[NB];
+  thread_attr_t attr;
+  struct rlimit old, lim;
+  unsigned long pages;
+  void *res;
+  FILE *f;
+  long i;
+  int err;
+
+  f = fopen("/proc/self/statm", "r");
+  assert(f);
+  err = fscanf(f, "%lu", &pages) != 1;
+  assert(!err);
+  fclose(f);
+
+  err = getrlimit(RLIMIT_AS, &old);
+  assert(!err);
+  lim = old;
+  lim.rlim_cur = pages * 4096 + 64 * 1024 * 1024;
+  err = setrlimit(RLIMIT_AS, &lim);
+  assert(!err);
+
+  thread_setspawnbacklog(0, NULL);
+  for (i = 0; i < NB; i++) {
+    thread_attr_init(&attr);
+    thread_attr_setstacksize(&attr, 1024 * 1024);
+    if (i % 2)
+      thread_attr_setspawnmode(&attr, THREAD_SPAWN_WORK_FIRST);
+    err = thread_create_attr(&th[i], &attr, thfunc, (void *) i);
+    assert(!err);
+  }
+  go = 1;
+
+  for (i = 0; i < NB; i++) {
+    err = thread_join(th[i], &res);
+    assert(!err);
+    assert(res == (void *) i);
+  }
+
+  err = setrlimit(RLIMIT_AS, &old);
+  assert(!err);
+
+  printf("%d threads avec des piles de 1 Mo dans 64 Mo\n", NB);
+  return 0;
+}